@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// 比较手写的Packet解析器和原先基于libcbor回调的解析速度
+// 用法: bench-packet-decoder [包的数量]
+
+#include "network/packet_decoder.h"
+
+static void appendHead(std::string &out, int major, uint64_t value) {
+  major <<= 5;
+  if (value < 24) {
+    out += (char)(major | value);
+    return;
+  }
+
+  int n = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFF ? 4 : 8;
+  out += (char)(major | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27));
+  for (int i = n - 1; i >= 0; i--) {
+    out += (char)((value >> (i * 8)) & 0xFF);
+  }
+}
+
+static void appendInt(std::string &out, int64_t value) {
+  if (value >= 0) appendHead(out, 0, value);
+  else appendHead(out, 1, -1 - value);
+}
+
+static void appendBytes(std::string &out, std::string_view sv) {
+  appendHead(out, 2, sv.size());
+  out += sv;
+}
+
+// 造一批和客户端实际发来的差不多的包：大部分是短的通知/回复，偶尔带长一点的数据
+static std::string makeFrames(int count) {
+  std::string out;
+  std::mt19937 rng { 1234 };
+  for (int i = 0; i < count; i++) {
+    bool is_request = rng() % 4 == 0;
+    appendHead(out, 4, is_request ? 6 : 4);
+    appendInt(out, is_request ? i : -2);
+    appendInt(out, 0x100 | 0x10 | 0x2);
+    appendBytes(out, i % 2 ? "PushRequest" : "Heartbeat");
+    appendBytes(out, std::string(rng() % 8 == 0 ? 600 : rng() % 40, '\x61'));
+    if (is_request) {
+      appendInt(out, 15);
+      appendInt(out, 1700000000000 + i);
+    }
+  }
+  return out;
+}
+
+template <typename F>
+static double measure(const char *name, int rounds, size_t bytes, F &&f) {
+  using namespace std::chrono;
+  auto start = steady_clock::now();
+  size_t handled = 0;
+  for (int i = 0; i < rounds; i++) {
+    handled += f();
+  }
+  auto ms = duration<double, std::milli>(steady_clock::now() - start).count();
+  fmt::print("{:<10} {:>10.2f} ms  {:>10.1f} MB/s  {} packets\n", name, ms,
+             (double)bytes * rounds / 1e6 / (ms / 1000), handled);
+  return ms;
+}
+
+int main(int argc, char **argv) {
+  int count = argc > 1 ? std::atoi(argv[1]) : 100000;
+  const int rounds = 10;
+  auto frames = makeFrames(count);
+  auto buf = (const unsigned char *)frames.data();
+  auto len = frames.size();
+
+  size_t sink = 0;
+
+  auto fast = measure("hand-rolled", rounds, len, [&] {
+    size_t handled = 0, total = 0, consumed = 0;
+    Packet pkt;
+    while (total < len &&
+           decodePacket(buf + total, len - total, pkt, consumed) == PacketDecodeStatus::Ok) {
+      sink += pkt.cborData.size();
+      total += consumed;
+      handled++;
+    }
+    return handled;
+  });
+
+  size_t handled = 0;
+  std::function<void(Packet &)> cb = [&](Packet &pkt) {
+    sink += pkt.cborData.size();
+    handled++;
+  };
+  auto slow = measure("libcbor", rounds, len, [&] {
+    handled = 0;
+    size_t consumed = 0;
+    decodePacketsLibcbor(buf, len, cb, consumed);
+    return handled;
+  });
+
+  fmt::print("speedup: {:.2f}x (checksum {})\n", slow / fast, sink);
+}
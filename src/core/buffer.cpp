@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "core/buffer.h"
+
+#include <cstring>
+
+ReadBuffer::ReadBuffer(size_t capacity) :
+  m_buf { std::make_unique<unsigned char[]>(capacity) }, m_capacity { capacity } {}
+
+size_t ReadBuffer::prepare(size_t min_free, size_t max_capacity) {
+  if (writable() >= min_free) return writable();
+
+  // 先试试把残留的半个包挪到开头
+  if (m_begin > 0 && m_pins == 0) {
+    auto len = size();
+    std::memmove(m_buf.get(), m_buf.get() + m_begin, len);
+    m_begin = 0;
+    m_end = len;
+    if (writable() >= min_free) return writable();
+  }
+
+  // 还不够就扩容，翻倍但不超过上限
+  // 钉住的时候不能原地挪，容量到顶了也换一块同样大的新内存把剩下的数据搬过去
+  if (m_capacity < max_capacity || (m_pins > 0 && m_begin > 0)) {
+    auto new_cap = std::max(m_capacity,
+                            std::min(std::max(m_capacity * 2, size() + min_free), max_capacity));
+    auto new_buf = std::make_unique<unsigned char[]>(new_cap);
+    std::memcpy(new_buf.get(), m_buf.get() + m_begin, size());
+    m_end = size();
+    m_begin = 0;
+    if (m_pins > 0) {
+      m_retired.push_back(std::move(m_buf));
+    }
+    m_buf = std::move(new_buf);
+    m_capacity = new_cap;
+  }
+
+  return writable();
+}
+
+void ReadBuffer::commit(size_t n) {
+  m_end += std::min(n, writable());
+}
+
+bool ReadBuffer::append(const void *src, size_t n, size_t max_capacity) {
+  if (prepare(n, max_capacity) < n) return false;
+  std::memcpy(writePtr(), src, n);
+  commit(n);
+  return true;
+}
+
+void ReadBuffer::consume(size_t n) {
+  m_begin += std::min(n, size());
+  if (m_begin == m_end && m_pins == 0) {
+    m_begin = m_end = 0;
+  }
+}
+
+void ReadBuffer::unpin() {
+  if (m_pins == 0 || --m_pins > 0) return;
+  m_retired.clear();
+  if (m_begin == m_end) {
+    m_begin = m_end = 0;
+  }
+}
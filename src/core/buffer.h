@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 收数据用的缓冲区：socket直接读进尾部空闲区，解析从头部往后消费
+// 只在尾部空间不够时才把剩下的半截数据挪回开头，或者在上限内扩容
+// 数据全部消费完时直接把读写位置归零，不会发生拷贝
+class ReadBuffer {
+public:
+  explicit ReadBuffer(size_t capacity);
+  ReadBuffer(ReadBuffer &) = delete;
+  ReadBuffer(ReadBuffer &&) = delete;
+
+  // 已读入、尚未被消费的数据
+  unsigned char *data() { return m_buf.get() + m_begin; }
+  size_t size() const { return m_end - m_begin; }
+
+  // 保证尾部至少有min_free字节可写（在max_capacity以内），返回可写的字节数
+  size_t prepare(size_t min_free, size_t max_capacity);
+  unsigned char *writePtr() { return m_buf.get() + m_end; }
+  size_t writable() const { return m_capacity - m_end; }
+
+  void commit(size_t n);
+  // 拷贝一段数据到尾部，超出上限时返回false
+  bool append(const void *src, size_t n, size_t max_capacity);
+  void consume(size_t n);
+
+  size_t capacity() const { return m_capacity; }
+
+  // 钉住期间已读入的数据（包括已经consume掉的）地址不变：prepare不原地挪数据，
+  // 扩容换下来的旧内存留到最后一次unpin再释放，consume读空了也不归零
+  // 用于处理某个包的过程中还要往同一个缓冲区里继续读的场合
+  void pin() { m_pins++; }
+  void unpin();
+
+private:
+  std::unique_ptr<unsigned char[]> m_buf;
+  size_t m_capacity;
+  size_t m_begin = 0;
+  size_t m_end = 0;
+
+  int m_pins = 0;
+  std::vector<std::unique_ptr<unsigned char[]>> m_retired;
+};
@@ -5,13 +5,21 @@
 #include <openssl/aes.h>
 
 namespace asio = boost::asio;
+namespace beast = boost::beast;
 using asio::awaitable;
 using asio::detached;
 using asio::use_awaitable;
 using asio::redirect_error;
 
+static std::atomic<size_t> total_queued_bytes = 0;
+static std::atomic<size_t> total_merged_frames = 0;
+static std::atomic<size_t> total_dropped_frames = 0;
+static std::atomic<size_t> total_evicted = 0;
+
 ClientSocket::ClientSocket(tcp::socket socket) : m_socket(std::move(socket)) {
   m_peer_address = m_socket.remote_endpoint().address().to_string();
+  m_handler_executor = m_socket.get_executor();
+  m_decoded_callback = [this](Packet &p) { onPacketDecoded(p); };
   disconnected_callback = [this] {
     spdlog::info("client {} disconnected", peerAddress());
   };
@@ -19,7 +27,49 @@ ClientSocket::ClientSocket(tcp::socket socket) : m_socket(std::move(socket)) {
 }
 
 void ClientSocket::start() {
-  asio::co_spawn(m_socket.get_executor(), reader(), detached);
+  asio::co_spawn(m_socket.get_executor(), m_ws ? wsReader() : reader(), detached);
+}
+
+awaitable<boost::system::error_code>
+ClientSocket::acceptWebSocket(beast::http::request<beast::http::string_body> req) {
+  m_ws = std::make_unique<beast::websocket::stream<tcp::socket &>>(m_socket);
+  m_ws->binary(true);
+  m_ws->read_message_max(m_max_frame_size);
+  m_ws->set_option(beast::websocket::stream_base::timeout::suggested(beast::role_type::server));
+
+  boost::system::error_code ec;
+  co_await m_ws->async_accept(req, redirect_error(use_awaitable, ec));
+  co_return ec;
+}
+
+bool ClientSocket::isWebSocket() const {
+  return m_ws != nullptr;
+}
+
+awaitable<void> ClientSocket::wsReader() {
+  auto self { shared_from_this() };
+
+  for (;;) {
+    // 每条消息读进一块新的内存，解析出来的包直接指向它，post给主线程时不用再拷贝
+    auto msg = std::make_shared<std::string>();
+    auto buf = asio::dynamic_buffer(*msg);
+    boost::system::error_code ec;
+    co_await m_ws->async_read(buf, redirect_error(use_awaitable, ec));
+
+    if (ec) break;
+
+    auto stat = self->handleMessage(std::move(msg));
+    if (stat == CBOR_DECODER_ERROR) {
+      spdlog::warn("Malformed data from client {}", self->peerAddress());
+      break;
+    }
+    if (m_buffer.size() >= m_max_frame_size) {
+      spdlog::warn("Frame from client {} exceeds {} bytes", self->peerAddress(), m_max_frame_size);
+      break;
+    }
+  }
+
+  self->emitDisconnected();
 }
 
 awaitable<void> ClientSocket::reader() {
@@ -27,23 +77,43 @@ awaitable<void> ClientSocket::reader() {
   auto self { shared_from_this() };
 
   for (;;) {
+    // 缓冲区里积压的半个包已经超过上限了，不必再等下去
+    if (m_buffer.size() >= m_max_frame_size) {
+      spdlog::warn("Frame from client {} exceeds {} bytes", self->peerAddress(), m_max_frame_size);
+      break;
+    }
+    m_buffer.prepare(min_read_length, std::max<size_t>(max_length, m_max_frame_size));
+
     boost::system::error_code ec;
     auto length = co_await m_socket.async_read_some(
-      asio::buffer(m_data, max_length), redirect_error(use_awaitable, ec));
+      asio::buffer(m_buffer.writePtr(), m_buffer.writable()), redirect_error(use_awaitable, ec));
 
     if (ec) break;
 
-    auto stat = self->handleBuffer(length);
+    m_buffer.commit(length);
+    auto stat = self->handleBuffer();
     if (stat == CBOR_DECODER_ERROR) {
       spdlog::warn("Malformed data from client {}", self->peerAddress());
       break;
     }
   }
 
-  self->disconnected_callback();
+  self->emitDisconnected();
+}
+
+void ClientSocket::emitDisconnected() {
+  auto f = [self = shared_from_this()] {
+    self->disconnected_callback();
 
-  self->set_message_got_callback([](Packet &){});
-  self->set_disconnected_callback([]{});
+    self->set_message_got_callback([](Packet &){});
+    self->set_disconnected_callback([]{});
+  };
+
+  if (m_post_to_handler) {
+    asio::post(m_handler_executor, f);
+  } else {
+    f();
+  }
 }
 
 asio::ip::tcp::socket &ClientSocket::socket() {
@@ -54,12 +124,39 @@ std::string_view ClientSocket::peerAddress() const {
   return m_peer_address;
 }
 
+void ClientSocket::setMaxFrameSize(size_t size) {
+  m_max_frame_size = size;
+  if (m_ws) m_ws->read_message_max(size);
+}
+
+void ClientSocket::enableCompression(size_t threshold) {
+  m_compressor = std::make_unique<FrameCompressor>(threshold);
+}
+
+FrameCompressor *ClientSocket::compressor() const {
+  return m_compressor.get();
+}
+
+void ClientSocket::setHandlerExecutor(asio::any_io_executor ex) {
+  m_handler_executor = ex;
+  m_post_to_handler = ex != m_socket.get_executor();
+}
+
 void ClientSocket::disconnectFromHost() {
-  try {
-    m_socket.shutdown(tcp::socket::shutdown_both);
-    m_socket.close();
-  } catch (std::exception &) {
-    // ignore
+  auto close = [self = shared_from_this()] {
+    try {
+      self->m_socket.shutdown(tcp::socket::shutdown_both);
+      self->m_socket.close();
+    } catch (std::exception &) {
+      // ignore
+    }
+  };
+
+  // socket不是线程安全的，得在它自己的线程上关
+  if (m_post_to_handler) {
+    asio::post(m_socket.get_executor(), close);
+  } else {
+    close();
   }
   disconnected_callback();
 
@@ -68,198 +165,249 @@ void ClientSocket::disconnectFromHost() {
   set_disconnected_callback([]{});
 }
 
-void ClientSocket::send(const std::shared_ptr<std::string> msg) {
-  asio::async_write(
-    m_socket,
-    asio::const_buffer { msg->data(), msg->size() },
-    detached
-  );
+void ClientSocket::setSendLimits(size_t soft, size_t hard) {
+  std::lock_guard<std::mutex> lock(m_send_mutex);
+  m_soft_limit = soft;
+  m_hard_limit = hard;
 }
 
-void ClientSocket::set_disconnected_callback(std::function<void()> f) {
-  disconnected_callback = f;
+size_t ClientSocket::queuedBytes() const {
+  return m_queued_bytes;
 }
 
-void ClientSocket::set_message_got_callback(std::function<void(Packet &)> f) {
-  message_got_callback = f;
+size_t ClientSocket::queuedFrames() const {
+  return m_queued_frames;
 }
 
-// private methods
+size_t ClientSocket::totalQueuedBytes() {
+  return total_queued_bytes;
+}
 
-void Packet::describe() {
-  spdlog::info("Item data: len={} reqId={} type={} command={} data={} bytes", _len, requestId, type, command, cborData.size());
-  cbor_load_result sz;
-  auto dat = cbor_load((cbor_data)cborData.data(), cborData.size(), &sz);
-  cbor_describe(dat, stdout);
-  cbor_decref(&dat);
+size_t ClientSocket::totalMergedFrames() {
+  return total_merged_frames;
 }
 
-struct PacketBuilder {
-  explicit PacketBuilder(Packet &p, auto &callback) : pkt { p }, message_got_callback { callback } {
-    reset();
-  }
+size_t ClientSocket::totalDroppedFrames() {
+  return total_dropped_frames;
+}
 
-  void handleInteger(int64_t value) {
-    if (!valid_packet) return;
+size_t ClientSocket::totalEvicted() {
+  return total_evicted;
+}
+
+void ClientSocket::dequeued(size_t bytes, size_t frames) {
+  m_queued_bytes -= bytes;
+  m_queued_frames -= frames;
+  total_queued_bytes -= bytes;
+}
 
-    switch (current_field) {
-      case 0: pkt.requestId = static_cast<int>(value); break;
-      case 1: pkt.type = static_cast<int>(value); break;
-      case 4: pkt.timeout = static_cast<int>(value); break;
-      case 5: pkt.timestamp = value; break;
-      default:
-        valid_packet = false;
+// 线程安全，任何线程都可以调用；按调用顺序发出
+void ClientSocket::send(const std::shared_ptr<const std::string> msg, int mergeKey) {
+  auto size = msg->size();
+  {
+    std::lock_guard<std::mutex> lock(m_send_mutex);
+    if (m_overflowed) return;
+
+    if (mergeKey != NoMerge && m_queued_bytes >= m_soft_limit) {
+      // 对面读得太慢了，不重要的消息能合并就合并，不能就扔掉
+      for (auto &f : m_send_queue) {
+        if (f.mergeKey != mergeKey) continue;
+        m_queued_bytes += size;
+        total_queued_bytes += size;
+        dequeued(f.msg->size(), 0);
+        f.msg = msg;
+        total_merged_frames++;
         return;
+      }
+      total_dropped_frames++;
+      return;
     }
 
-    nextField();
+    if (m_queued_bytes + size > m_hard_limit) {
+      // 积压太多了，不等了，直接断开；断线的后续处理交给reader
+      spdlog::warn("client {} is too slow to consume {} queued bytes, disconnecting",
+                   peerAddress(), m_queued_bytes.load());
+      m_overflowed = true;
+      total_evicted++;
+      for (auto &f : m_send_queue) {
+        dequeued(f.msg->size(), 1);
+      }
+      m_send_queue.clear();
+      asio::post(m_socket.get_executor(), [self = shared_from_this()] {
+        boost::system::error_code ec;
+        self->m_socket.shutdown(tcp::socket::shutdown_both, ec);
+        self->m_socket.close(ec);
+      });
+      return;
+    }
+
+    m_send_queue.push_back({ msg, mergeKey });
+    m_queued_bytes += size;
+    m_queued_frames++;
+    total_queued_bytes += size;
+    if (m_writing) return;
+    m_writing = true;
   }
 
-  void handleBytes(const cbor_data data, size_t len) {
-    if (!valid_packet) return;
-    std::string_view sv { (char *)data, len };
+  // co_spawn会先post到socket所在的io_context，这期间到来的消息也能赶上这一轮
+  asio::co_spawn(m_socket.get_executor(), writer(), detached);
+}
 
-    switch (current_field) {
-      case 2:
-        pkt.command = sv;
-        break;
-      case 3:
-        pkt.cborData = sv;
+awaitable<void> ClientSocket::writer() {
+  auto self { shared_from_this() };
+
+  std::vector<OutFrame> sending;
+  std::vector<asio::const_buffer> buffers;
+  size_t sending_bytes = 0;
+
+  for (;;) {
+    {
+      // 把目前攒下的消息全部取走，一次writev发完
+      std::lock_guard<std::mutex> lock(m_send_mutex);
+      if (m_send_queue.empty()) {
+        m_writing = false;
         break;
-      default:
-        valid_packet = false;
-        return;
+      }
+      sending.swap(m_send_queue);
     }
 
-    nextField();
-  }
-
-  void startArray(size_t size) {
-    pkt._len = size;
-    valid_packet = true;
-    if (size != 4 && size != 6) {
-      valid_packet = false;
+    buffers.clear();
+    buffers.reserve(sending.size());
+    sending_bytes = 0;
+    for (auto &f : sending) {
+      buffers.emplace_back(f.msg->data(), f.msg->size());
+      sending_bytes += f.msg->size();
     }
-  }
 
-  void reset() {
-    pkt.type = 0;
-    pkt._len = 0;
-    pkt.command = "";
-    pkt.cborData = "";
-    current_field = 0;
-    valid_packet = false;
-  }
+    boost::system::error_code ec;
+    if (m_ws) {
+      // 一批消息合成一条WebSocket消息发出去
+      co_await m_ws->async_write(buffers, redirect_error(use_awaitable, ec));
+    } else {
+      co_await asio::async_write(m_socket, buffers, redirect_error(use_awaitable, ec));
+    }
 
-  void nextField() {
-    current_field++;
-    if (current_field == pkt._len) {
-      message_got_callback(pkt);
-      handled++;
-      reset();
+    {
+      std::lock_guard<std::mutex> lock(m_send_mutex);
+      dequeued(sending_bytes, sending.size());
+      sending.clear();
+
+      if (ec) {
+        // 连接已经断了，剩下的也不用发了；断线由reader那边处理
+        for (auto &f : m_send_queue) {
+          dequeued(f.msg->size(), 1);
+        }
+        m_send_queue.clear();
+        m_writing = false;
+        break;
+      }
     }
   }
+}
 
-  Packet &pkt;
-  std::function<void(Packet &)> &message_got_callback;
-  int current_field = 0;
-  bool valid_packet = false;
-  int handled = 0;
-};
-
-static struct cbor_callbacks callbacks = cbor_empty_callbacks;
-static std::once_flag callbacks_flag;
-
-static void init_callbacks() {
-  callbacks.uint8 = [](void* self, uint8_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(value);
-  };
-  callbacks.uint16 = [](void* self, uint16_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(value);
-  };
-  callbacks.uint32 = [](void* self, uint32_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(value);
-  };
-  callbacks.uint64 = [](void* self, uint64_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(value);
-  };
-  callbacks.negint8 = [](void* self, uint8_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
-  };
-  callbacks.negint16 = [](void* self, uint16_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
-  };
-  callbacks.negint32 = [](void* self, uint32_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
-  };
-  callbacks.negint64 = [](void* self, uint64_t value) {
-    static_cast<PacketBuilder*>(self)->handleInteger(-1 - static_cast<int64_t>(value));
-  };
-  callbacks.byte_string = [](void* self, const cbor_data data, uint64_t len) {
-    static_cast<PacketBuilder*>(self)->handleBytes(data, len);
-  };
-  callbacks.array_start = [](void* self, uint64_t size) {
-    static_cast<PacketBuilder*>(self)->startArray(size);
-  };
+void ClientSocket::set_disconnected_callback(std::function<void()> f) {
+  disconnected_callback = f;
 }
 
-cbor_decoder_status ClientSocket::handleBuffer(size_t length) {
-  cborBuffer.insert(cborBuffer.end(), m_data, m_data + length);
+void ClientSocket::set_message_got_callback(std::function<void(Packet &)> f) {
+  message_got_callback = f;
+}
 
-  auto cbuf = (unsigned char *)cborBuffer.data();
-  auto len = cborBuffer.size();
-  size_t total_consumed = 0;
+// private methods
 
-  size_t real_consumed = 0;
-  // spdlog::debug("client socket buffer: {}", std::string_view{ (char*)cborBuffer.data(), cborBuffer.size() });
+cbor_decoder_status ClientSocket::handleBuffer() {
+  size_t consumed = 0;
+  auto stat = decodeFrames(m_buffer.data(), m_buffer.size(), consumed, nullptr);
+  // 只丢掉已经处理完的完整包，剩下的半个包原地留着等下次读
+  m_buffer.consume(consumed);
+  return stat;
+}
 
-  std::call_once(callbacks_flag, init_callbacks);
+cbor_decoder_status ClientSocket::handleMessage(std::shared_ptr<const std::string> msg) {
+  auto max_capacity = std::max<size_t>(max_length, m_max_frame_size);
+  if (m_buffer.size() > 0) {
+    // 上一条消息末尾还剩半个包，只能拼起来解析了
+    if (!m_buffer.append(msg->data(), msg->size(), max_capacity)) {
+      return CBOR_DECODER_ERROR;
+    }
+    return handleBuffer();
+  }
 
-  struct cbor_decoder_result decode_result;
-  Packet pkt;
-  PacketBuilder builder { pkt, message_got_callback };
-  int handled = 0;
-
-  cbor_decoder_status lastStat;
-
-  while (true) {
-    // 基于callbacks，边读缓冲区边构造packet并进一步调用回调处理packet
-    // 下面这个函数一次只读一个item
-    decode_result = cbor_stream_decode(cbuf, len, &callbacks, &builder);
-    lastStat = decode_result.status;
-    if (decode_result.status == CBOR_DECODER_ERROR) {
-      return lastStat;
-    } else if (decode_result.status == CBOR_DECODER_NEDATA) {
-      break;
+  size_t consumed = 0;
+  auto stat = decodeFrames((const unsigned char *)msg->data(), msg->size(), consumed, msg);
+  if (stat != CBOR_DECODER_ERROR && consumed < msg->size()) {
+    if (!m_buffer.append(msg->data() + consumed, msg->size() - consumed, max_capacity)) {
+      return CBOR_DECODER_ERROR;
     }
+  }
+  return stat;
+}
 
-    if (decode_result.read != 0) {
-      cbuf += decode_result.read;
-      len -= decode_result.read;
-      total_consumed += decode_result.read;
-    } else {
+// backing非空时buf就是backing的内容，post给handler时可以直接共享不用拷贝
+cbor_decoder_status ClientSocket::decodeFrames(const unsigned char *cbuf, size_t len, size_t &total_consumed,
+                                               const std::shared_ptr<const std::string> &backing) {
+  total_consumed = 0;
+  m_decode_base = cbuf;
+
+  Packet pkt;
+  while (total_consumed < len) {
+    size_t consumed = 0;
+    auto stat = decodePacket(cbuf + total_consumed, len - total_consumed, pkt, consumed);
+    if (stat == PacketDecodeStatus::NeedMore) {
       break;
+    } else if (stat == PacketDecodeStatus::Fallback) {
+      // 编码方式比较少见，剩下的交给libcbor慢慢解析
+      auto ret = decodePacketsLibcbor(cbuf + total_consumed, len - total_consumed,
+                                      m_decoded_callback, consumed);
+      total_consumed += consumed;
+      flushPendingPackets(total_consumed, backing);
+      return ret;
     }
 
-    if (builder.handled != handled) {
-      real_consumed = total_consumed;
-    }
+    onPacketDecoded(pkt);
+    total_consumed += consumed;
   }
 
-  if (builder.handled == 0 && !builder.valid_packet) {
-    return lastStat;
-  }
+  flushPendingPackets(total_consumed, backing);
 
-  // 对剩余的不全数据深拷贝 重新造bytes
-  if (real_consumed < len) {
-    std::vector<unsigned char> remaining_buffer;
-    remaining_buffer.assign(cborBuffer.begin() + real_consumed, cborBuffer.end());
-    cborBuffer = remaining_buffer;
-  } else {
-    cborBuffer.clear();
+  return CBOR_DECODER_FINISHED;
+}
+
+void ClientSocket::onPacketDecoded(Packet &pkt) {
+  if (!m_post_to_handler) {
+    message_got_callback(pkt);
+    return;
   }
 
-  return lastStat;
+  auto base = (const char *)m_decode_base;
+  m_pending_packets.push_back({
+    pkt.requestId, pkt.type, pkt.timeout, pkt._len, pkt.timestamp,
+    (size_t)(pkt.command.data() - base), pkt.command.size(),
+    (size_t)(pkt.cborData.data() - base), pkt.cborData.size(),
+  });
+}
+
+// 这一轮读到的完整包打包post给handler线程；数据不是独立的一块内存时整体拷贝一次
+void ClientSocket::flushPendingPackets(size_t consumed, const std::shared_ptr<const std::string> &backing) {
+  if (m_pending_packets.empty()) return;
+
+  auto bytes = backing ? backing :
+    std::make_shared<const std::string>((const char *)m_decode_base, consumed);
+  asio::post(m_handler_executor, [self = shared_from_this(), bytes,
+             packets = std::move(m_pending_packets)] {
+    Packet pkt;
+    for (auto &p : packets) {
+      pkt.requestId = p.requestId;
+      pkt.type = p.type;
+      pkt.timeout = p.timeout;
+      pkt._len = p._len;
+      pkt.timestamp = p.timestamp;
+      pkt.command = std::string_view { bytes->data() + p.command_offset, p.command_size };
+      pkt.cborData = std::string_view { bytes->data() + p.data_offset, p.data_size };
+      self->message_got_callback(pkt);
+    }
+  });
+  m_pending_packets.clear();
 }
 
 
@@ -4,25 +4,9 @@
 
 #include <openssl/aes.h>
 
-// 为了省那几字节重排了一下字段
-// 实际应当是 `[ reqId, type, command, data, timeout, timestamp ]`
-
-// Router负责处理的东西
-struct Packet {
-  int requestId;
-  int type;
-  int timeout;
-  int _len;
-  int64_t timestamp;
-  std::string_view command;
-  std::string_view cborData;
-
-  Packet() = default;
-  Packet(Packet &) = delete;
-  Packet(Packet &&) = delete;
-
-  void describe();
-};
+#include "core/buffer.h"
+#include "network/packet_decoder.h"
+#include "network/compressor.h"
 
 class ClientSocket : public std::enable_shared_from_this<ClientSocket> {
 public:
@@ -35,11 +19,47 @@ public:
 
   void start();
 
+  // WebSocket连接：HttpListener收到升级请求后调用，握手完成后再start()
+  // 之后收发的都是二进制消息，消息内容和TCP连接的字节流格式完全一样
+  boost::asio::awaitable<boost::system::error_code>
+    acceptWebSocket(boost::beast::http::request<boost::beast::http::string_body> req);
+  bool isWebSocket() const;
+
   tcp::socket &socket();
   std::string_view peerAddress() const;
 
+  // 单个包的最大长度，超出的直接断开，免得缓冲区被撑爆
+  void setMaxFrameSize(size_t size);
+
+  // 客户端在Setup中声明支持压缩时启用，之后超过阈值的包的data字段会被压缩
+  void enableCompression(size_t threshold);
+  FrameCompressor *compressor() const;
+
+  // 收到的包和断线信号交给哪个executor处理（一般是主线程）
+  // 与socket自己的executor不同时，拆好的包会拷贝一份post过去
+  void setHandlerExecutor(boost::asio::any_io_executor ex);
+
+  // 可以合并的消息种类：积压超过软上限时同种消息在队列中只保留最新的一条
+  // 队列里没有可合并的就直接丢弃，反正是无关紧要的消息
+  enum MergeKey {
+    NoMerge = 0,
+    MergeHeartbeat,
+    MergeOnlineCount,
+  };
+
+  // 发送队列的积压上限（字节），超过软上限开始合并/丢弃消息，超过硬上限直接断开
+  void setSendLimits(size_t soft, size_t hard);
+  size_t queuedBytes() const;
+  size_t queuedFrames() const;
+
+  // 全局统计，给shell的stat用
+  static size_t totalQueuedBytes();
+  static size_t totalMergedFrames();
+  static size_t totalDroppedFrames();
+  static size_t totalEvicted();
+
   void disconnectFromHost();
-  void send(const std::shared_ptr<std::string> msg);
+  void send(const std::shared_ptr<const std::string> msg, int mergeKey = NoMerge);
 
   // signal connectors
   void set_disconnected_callback(std::function<void()>);
@@ -55,20 +75,69 @@ public:
 
 private:
   tcp::socket m_socket;
-  enum { max_length = 32768 };
-  char m_data[max_length];
+  std::unique_ptr<boost::beast::websocket::stream<tcp::socket &>> m_ws;
+  enum { max_length = 32768, min_read_length = 4096 };
+  // socket直接读进这里，Packet里面的string_view也都指向这里
+  ReadBuffer m_buffer { max_length };
+  size_t m_max_frame_size = 1024 * 1024;
+
+  std::unique_ptr<FrameCompressor> m_compressor;
+
+  boost::asio::any_io_executor m_handler_executor;
+  bool m_post_to_handler = false;
+
+  // 等待post给handler的包，string_view换成了相对m_buffer开头的偏移量
+  struct PendingPacket {
+    int requestId;
+    int type;
+    int timeout;
+    int _len;
+    int64_t timestamp;
+    size_t command_offset, command_size;
+    size_t data_offset, data_size;
+  };
+  std::vector<PendingPacket> m_pending_packets;
+  const unsigned char *m_decode_base = nullptr;
+  // 给libcbor解析器用的回调，转发给onPacketDecoded
+  std::function<void(Packet &)> m_decoded_callback;
 
   std::string m_peer_address;
 
-  std::vector<unsigned char> cborBuffer;
-
-  cbor_decoder_status handleBuffer(size_t length);
+  // 发送队列：同一时刻只有一个async_write在途，
+  // 其间积攒下来的消息在下一轮合并成一次gather write发出去
+  // RoomThread也会直接往里塞消息，所以要上锁
+  struct OutFrame {
+    std::shared_ptr<const std::string> msg;
+    int mergeKey;
+  };
+  std::mutex m_send_mutex;
+  std::vector<OutFrame> m_send_queue;
+  bool m_writing = false;
+  bool m_overflowed = false;
+
+  // 队列中和正在发送中的消息都算
+  std::atomic<size_t> m_queued_bytes = 0;
+  std::atomic<size_t> m_queued_frames = 0;
+  size_t m_soft_limit = std::numeric_limits<size_t>::max();
+  size_t m_hard_limit = std::numeric_limits<size_t>::max();
+
+  void dequeued(size_t bytes, size_t frames);
+
+  cbor_decoder_status handleBuffer();
+  cbor_decoder_status handleMessage(std::shared_ptr<const std::string> msg);
+  cbor_decoder_status decodeFrames(const unsigned char *buf, size_t len, size_t &total_consumed,
+                                   const std::shared_ptr<const std::string> &backing);
+  void onPacketDecoded(Packet &pkt);
+  void flushPendingPackets(size_t consumed, const std::shared_ptr<const std::string> &backing);
+  void emitDisconnected();
 
   // signals
   std::function<void()> disconnected_callback = 0;
   std::function<void(Packet &)> message_got_callback = 0;
 
   boost::asio::awaitable<void> reader();
+  boost::asio::awaitable<void> wsReader();
+  boost::asio::awaitable<void> writer();
 
   /*
   QByteArray aesEnc(const QByteArray &in);
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "network/compressor.h"
+
+namespace zlib = boost::beast::zlib;
+
+static std::atomic<size_t> total_bytes_in = 0;
+static std::atomic<size_t> total_bytes_out = 0;
+
+FrameCompressor::FrameCompressor(size_t threshold) : m_threshold { threshold } {
+  // 网络包讲究个快，压缩等级不用太高
+  m_stream.reset(4, 15, 8, zlib::Strategy::normal);
+}
+
+bool FrameCompressor::compress(const std::string_view &data, std::string &out) {
+  if (data.size() < m_threshold) return false;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  out.resize(m_stream.upper_bound(data.size()));
+
+  zlib::z_params zs;
+  zs.next_in = data.data();
+  zs.avail_in = data.size();
+  zs.next_out = out.data();
+  zs.avail_out = out.size();
+
+  boost::system::error_code ec;
+  m_stream.write(zs, zlib::Flush::finish, ec);
+  // 压完了要重置，下一个包从头开始
+  m_stream.reset();
+
+  if (ec != zlib::error::end_of_stream || zs.total_out >= data.size()) {
+    return false;
+  }
+
+  out.resize(zs.total_out);
+  total_bytes_in += data.size();
+  total_bytes_out += zs.total_out;
+  return true;
+}
+
+size_t FrameCompressor::threshold() const {
+  return m_threshold;
+}
+
+size_t FrameCompressor::totalBytesIn() {
+  return total_bytes_in;
+}
+
+size_t FrameCompressor::totalBytesOut() {
+  return total_bytes_out;
+}
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 发给客户端的大包的压缩器，每个连接一个
+// 每个包单独压成完整的raw deflate流（RFC 1951），客户端可以逐包独立解压
+// deflate_stream的内部缓冲区在包与包之间复用，不用每次重新分配
+class FrameCompressor {
+public:
+  FrameCompressor() = delete;
+  FrameCompressor(FrameCompressor &) = delete;
+  FrameCompressor(FrameCompressor &&) = delete;
+  explicit FrameCompressor(size_t threshold);
+
+  // 数据达到阈值并且压完确实变小了才返回true，结果放在out里
+  // 线程安全，主线程和RoomThread可能同时给同一个玩家发消息
+  bool compress(const std::string_view &data, std::string &out);
+
+  size_t threshold() const;
+
+  // 全局统计，给shell的stat用
+  static size_t totalBytesIn();
+  static size_t totalBytesOut();
+
+private:
+  std::mutex m_mutex;
+  boost::beast::zlib::deflate_stream m_stream;
+  size_t m_threshold;
+};
@@ -1,4 +1,8 @@
-#include "http_listener.h"
+#include "network/http_listener.h"
+#include "network/client_socket.h"
+
+#include "server/server.h"
+#include "server/user/user_manager.h"
 
 #include <cjson/cJSON.h>
 
@@ -18,8 +22,12 @@ HttpListener::HttpListener(tcp::endpoint end) :
 }
 
 HttpListener::~HttpListener() {
+  stop();
+}
+
+void HttpListener::stop() {
   io_ctx.stop();
-  m_thread.join();
+  if (m_thread.joinable()) m_thread.join();
 }
 
 void HttpListener::start() {
@@ -60,6 +68,24 @@ static awaitable<void> session(beast::tcp_stream stream) {
     co_await http::async_read(stream, buffer, req, redirect_error(use_awaitable, ec));
     if (ec) break;
 
+    if (beast::websocket::is_upgrade(req)) {
+      // socket交给ClientSocket，握手完了再交给主线程去走登录流程
+      auto conn = std::make_shared<ClientSocket>(stream.release_socket());
+      ec = co_await conn->acceptWebSocket(std::move(req));
+      if (ec) {
+        spdlog::warn("WebSocket handshake error: {}", ec.message());
+        co_return;
+      }
+
+      auto &main_ctx = Server::instance().context();
+      conn->setHandlerExecutor(main_ctx.get_executor());
+      asio::post(main_ctx, [conn] {
+        Server::instance().user_manager().processNewConnection(conn);
+        conn->start();
+      });
+      co_return;
+    }
+
     // TODO 按照example中的添加一下http处理逻辑
     http::response<http::string_body> res{ http::status::ok, req.version() };
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
@@ -1,5 +1,8 @@
 #pragma once
 
+// 自己单独一个线程和io_context
+// 普通的HTTP请求留给以后做API用；WebSocket升级请求则交给ClientSocket，
+// 之后和TCP客户端走完全一样的Packet/Router流程
 class HttpListener {
 public:
   using io_context = boost::asio::io_context;
@@ -13,6 +16,7 @@ public:
   ~HttpListener();
 
   void start();
+  void stop();
 
 private:
   io_context io_ctx;
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "network/io_pool.h"
+
+namespace asio = boost::asio;
+
+IoContextPool::IoContextPool(size_t size) {
+  for (size_t i = 0; i < std::max<size_t>(size, 1); i++) {
+    auto &ctx = m_contexts.emplace_back(std::make_unique<io_context>(1));
+    m_guards.emplace_back(asio::make_work_guard(*ctx));
+  }
+}
+
+IoContextPool::~IoContextPool() {
+  stop();
+}
+
+void IoContextPool::start() {
+  for (auto &ctx : m_contexts) {
+    m_threads.emplace_back([&ctx] {
+      ctx->run();
+    });
+  }
+  spdlog::info("started {} network threads", m_contexts.size());
+}
+
+void IoContextPool::stop() {
+  m_guards.clear();
+  for (auto &ctx : m_contexts) {
+    ctx->stop();
+  }
+  for (auto &t : m_threads) {
+    if (t.joinable()) t.join();
+  }
+  m_threads.clear();
+}
+
+asio::io_context &IoContextPool::next() {
+  return *m_contexts[m_next++ % m_contexts.size()];
+}
+
+size_t IoContextPool::size() const {
+  return m_contexts.size();
+}
@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 网络线程池：每个线程跑一个自己的io_context
+// 客户端连接建立时轮流分到各个io_context上，socket读写和拆包都在那边做
+// 大厅、房间这些会改状态的逻辑仍然回到主线程执行
+class IoContextPool {
+public:
+  using io_context = boost::asio::io_context;
+
+  IoContextPool() = delete;
+  IoContextPool(IoContextPool &) = delete;
+  IoContextPool(IoContextPool &&) = delete;
+  explicit IoContextPool(size_t size);
+  ~IoContextPool();
+
+  void start();
+  void stop();
+
+  // 轮询着挑一个io_context
+  io_context &next();
+  size_t size() const;
+
+private:
+  using work_guard = boost::asio::executor_work_guard<io_context::executor_type>;
+
+  std::vector<std::unique_ptr<io_context>> m_contexts;
+  std::vector<work_guard> m_guards;
+  std::vector<std::thread> m_threads;
+  std::atomic<size_t> m_next = 0;
+};
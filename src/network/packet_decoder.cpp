@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "network/packet_decoder.h"
+
+void Packet::describe() {
+  spdlog::info("Item data: len={} reqId={} type={} command={} data={} bytes", _len, requestId, type, command, cborData.size());
+  cbor_load_result sz;
+  auto dat = cbor_load((cbor_data)cborData.data(), cborData.size(), &sz);
+  cbor_describe(dat, stdout);
+  cbor_decref(&dat);
+}
+
+// 读一个CBOR数据项的头部，返回头部的字节数；0表示数据不够，-1表示不支持的编码
+static inline int readHead(const unsigned char *p, size_t len, int &major, uint64_t &value) {
+  if (len == 0) [[unlikely]] return 0;
+
+  major = p[0] >> 5;
+  int info = p[0] & 0x1f;
+  // 绝大多数整数和command都很小，值直接就在头部里面
+  if (info < 24) [[likely]] {
+    value = info;
+    return 1;
+  }
+
+  size_t n;
+  switch (info) {
+    case 24: n = 1; break;
+    case 25: n = 2; break;
+    case 26: n = 4; break;
+    case 27: n = 8; break;
+    default: return -1; // 不定长或者保留值
+  }
+  if (len < n + 1) return 0;
+
+  value = 0;
+  for (size_t i = 1; i <= n; i++) {
+    value = (value << 8) | p[i];
+  }
+  return n + 1;
+}
+
+static inline PacketDecodeStatus readInt(const unsigned char *&p, const unsigned char *end, int64_t &out) {
+  int major; uint64_t value;
+  auto n = readHead(p, end - p, major, value);
+  if (n == 0) return PacketDecodeStatus::NeedMore;
+  if (n < 0 || value > (uint64_t)std::numeric_limits<int64_t>::max())
+    return PacketDecodeStatus::Fallback;
+
+  if (major == 0) {
+    out = static_cast<int64_t>(value);
+  } else if (major == 1) {
+    out = -1 - static_cast<int64_t>(value);
+  } else {
+    return PacketDecodeStatus::Fallback;
+  }
+
+  p += n;
+  return PacketDecodeStatus::Ok;
+}
+
+static inline PacketDecodeStatus readBytes(const unsigned char *&p, const unsigned char *end, std::string_view &out) {
+  int major; uint64_t value;
+  auto n = readHead(p, end - p, major, value);
+  if (n == 0) return PacketDecodeStatus::NeedMore;
+  if (n < 0 || major != 2) return PacketDecodeStatus::Fallback;
+  if ((uint64_t)(end - p - n) < value) return PacketDecodeStatus::NeedMore;
+
+  out = { (const char *)p + n, value };
+  p += n + value;
+  return PacketDecodeStatus::Ok;
+}
+
+PacketDecodeStatus decodePacket(const unsigned char *buf, size_t len,
+                                Packet &pkt, size_t &consumed) {
+  using enum PacketDecodeStatus;
+
+  auto p = buf;
+  auto end = buf + len;
+  int major; uint64_t size;
+  auto n = readHead(p, len, major, size);
+  if (n == 0) return NeedMore;
+  if (n < 0 || major != 4 || (size != 4 && size != 6)) return Fallback;
+  p += n;
+
+  int64_t reqId, type, timeout = 0, timestamp = 0;
+  std::string_view command, data;
+  PacketDecodeStatus stat;
+
+  if ((stat = readInt(p, end, reqId)) != Ok) return stat;
+  if ((stat = readInt(p, end, type)) != Ok) return stat;
+  if ((stat = readBytes(p, end, command)) != Ok) return stat;
+  if ((stat = readBytes(p, end, data)) != Ok) return stat;
+  if (size == 6) {
+    if ((stat = readInt(p, end, timeout)) != Ok) return stat;
+    if ((stat = readInt(p, end, timestamp)) != Ok) return stat;
+  }
+
+  pkt._len = size;
+  pkt.requestId = static_cast<int>(reqId);
+  pkt.type = static_cast<int>(type);
+  pkt.command = command;
+  pkt.cborData = data;
+  pkt.timeout = static_cast<int>(timeout);
+  pkt.timestamp = timestamp;
+
+  consumed = p - buf;
+  return Ok;
+}
+
+// 以下是libcbor版本
+
+struct PacketBuilder {
+  explicit PacketBuilder(Packet &p, auto &callback) : pkt { p }, message_got_callback { callback } {
+    reset();
+  }
+
+  void handleInteger(int64_t value) {
+    if (!valid_packet) return;
+
+    switch (current_field) {
+      case 0: pkt.requestId = static_cast<int>(value); break;
+      case 1: pkt.type = static_cast<int>(value); break;
+      case 4: pkt.timeout = static_cast<int>(value); break;
+      case 5: pkt.timestamp = value; break;
+      default:
+        valid_packet = false;
+        return;
+    }
+
+    nextField();
+  }
+
+  void handleBytes(const cbor_data data, size_t len) {
+    if (!valid_packet) return;
+    std::string_view sv { (char *)data, len };
+
+    switch (current_field) {
+      case 2:
+        pkt.command = sv;
+        break;
+      case 3:
+        pkt.cborData = sv;
+        break;
+      default:
+        valid_packet = false;
+        return;
+    }
+
+    nextField();
+  }
+
+  void startArray(size_t size) {
+    pkt._len = size;
+    valid_packet = true;
+    if (size != 4 && size != 6) {
+      valid_packet = false;
+    }
+  }
+
+  void reset() {
+    pkt.type = 0;
+    pkt._len = 0;
+    pkt.command = "";
+    pkt.cborData = "";
+    current_field = 0;
+    valid_packet = false;
+  }
+
+  void nextField() {
+    current_field++;
+    if (current_field == pkt._len) {
+      message_got_callback(pkt);
+      handled++;
+      reset();
+    }
+  }
+
+  Packet &pkt;
+  std::function<void(Packet &)> &message_got_callback;
+  int current_field = 0;
+  bool valid_packet = false;
+  int handled = 0;
+};
+
+static struct cbor_callbacks callbacks = cbor_empty_callbacks;
+static std::once_flag callbacks_flag;
+
+static void init_callbacks() {
+  callbacks.uint8 = [](void* self, uint8_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(value);
+  };
+  callbacks.uint16 = [](void* self, uint16_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(value);
+  };
+  callbacks.uint32 = [](void* self, uint32_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(value);
+  };
+  callbacks.uint64 = [](void* self, uint64_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(value);
+  };
+  callbacks.negint8 = [](void* self, uint8_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
+  };
+  callbacks.negint16 = [](void* self, uint16_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
+  };
+  callbacks.negint32 = [](void* self, uint32_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(-1 - value);
+  };
+  callbacks.negint64 = [](void* self, uint64_t value) {
+    static_cast<PacketBuilder*>(self)->handleInteger(-1 - static_cast<int64_t>(value));
+  };
+  callbacks.byte_string = [](void* self, const cbor_data data, uint64_t len) {
+    static_cast<PacketBuilder*>(self)->handleBytes(data, len);
+  };
+  callbacks.array_start = [](void* self, uint64_t size) {
+    static_cast<PacketBuilder*>(self)->startArray(size);
+  };
+}
+
+cbor_decoder_status decodePacketsLibcbor(const unsigned char *buf, size_t len,
+                                         std::function<void(Packet &)> &callback,
+                                         size_t &consumed) {
+  auto cbuf = buf;
+  size_t total_consumed = 0;
+  consumed = 0;
+
+  std::call_once(callbacks_flag, init_callbacks);
+
+  struct cbor_decoder_result decode_result;
+  Packet pkt;
+  PacketBuilder builder { pkt, callback };
+  int handled = 0;
+
+  cbor_decoder_status lastStat = CBOR_DECODER_NEDATA;
+
+  while (len > 0) {
+    // 基于callbacks，边读缓冲区边构造packet并进一步调用回调处理packet
+    // 下面这个函数一次只读一个item
+    decode_result = cbor_stream_decode(cbuf, len, &callbacks, &builder);
+    lastStat = decode_result.status;
+    if (decode_result.status == CBOR_DECODER_ERROR) {
+      return lastStat;
+    } else if (decode_result.status == CBOR_DECODER_NEDATA) {
+      break;
+    }
+
+    if (decode_result.read != 0) {
+      cbuf += decode_result.read;
+      len -= decode_result.read;
+      total_consumed += decode_result.read;
+    } else {
+      break;
+    }
+
+    // 只有凑齐了整个包才算消费掉，半个包得留着下次接着读
+    if (builder.handled != handled) {
+      handled = builder.handled;
+      consumed = total_consumed;
+    }
+  }
+
+  return lastStat;
+}
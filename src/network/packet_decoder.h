@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// 为了省那几字节重排了一下字段
+// 实际应当是 `[ reqId, type, command, data, timeout, timestamp ]`
+
+// Router负责处理的东西
+struct Packet {
+  int requestId;
+  int type;
+  int timeout;
+  int _len;
+  int64_t timestamp;
+  std::string_view command;
+  std::string_view cborData;
+
+  Packet() = default;
+  Packet(Packet &) = delete;
+  Packet(Packet &&) = delete;
+
+  void describe();
+};
+
+enum class PacketDecodeStatus {
+  Ok,        // 解出了一个完整的包
+  NeedMore,  // 数据还不够一个包
+  Fallback,  // 遇到了不常见的编码，交给libcbor
+};
+
+// 专门针对客户端包结构的解析器，一次解析一整个包
+// 只认定长数组里面的整数和定长bytes，其他编码方式一律返回Fallback
+// 成功时pkt中的string_view指向buf，consumed为这个包占用的字节数
+PacketDecodeStatus decodePacket(const unsigned char *buf, size_t len,
+                                Packet &pkt, size_t &consumed);
+
+// 基于libcbor流式解析的版本，能处理任何合法的CBOR编码，但是慢
+// 每解出一个包就调用一次callback，consumed为已处理完的完整包的总字节数
+cbor_decoder_status decodePacketsLibcbor(const unsigned char *buf, size_t len,
+                                         std::function<void(Packet &)> &callback,
+                                         size_t &consumed);
@@ -3,7 +3,6 @@
 #include "network/router.h"
 #include "network/client_socket.h"
 #include "server/user/player.h"
-#include "server/server.h"
 #include "core/c-wrapper.h"
 
 namespace asio = boost::asio;
@@ -11,7 +10,6 @@ namespace asio = boost::asio;
 Router::Router(Player *player, std::shared_ptr<ClientSocket> socket, RouterType type) {
   this->type = type;
   this->player = player;
-  this->socket = nullptr;
   setSocket(socket);
 }
 
@@ -20,19 +18,25 @@ Router::~Router() {
   abortRequest();
 }
 
-std::shared_ptr<ClientSocket> Router::getSocket() const { return socket; }
+std::shared_ptr<ClientSocket> Router::getSocket() const {
+  std::lock_guard<std::mutex> lock(socketMutex);
+  return socket;
+}
 
 void Router::setSocket(std::shared_ptr<ClientSocket> socket) {
-  if (this->socket != nullptr) {
-    this->socket->set_message_got_callback([](Packet&){});
-    this->socket->set_disconnected_callback([]{});
-  }
-
-  this->socket = nullptr;
   if (socket != nullptr) {
     socket->set_message_got_callback([this](Packet &p) { handlePacket(p); });
     socket->set_disconnected_callback([this] { player->onDisconnected(); });
-    this->socket = socket;
+  }
+
+  std::shared_ptr<ClientSocket> old;
+  {
+    std::lock_guard<std::mutex> lock(socketMutex);
+    old = std::exchange(this->socket, socket);
+  }
+  if (old != nullptr && old != socket) {
+    old->set_message_got_callback([](Packet&){});
+    old->set_disconnected_callback([]{});
   }
 }
 
@@ -61,25 +65,46 @@ void Router::request(int type, const std::string_view &command,
   m_reply = "__notready";
   replyMutex.unlock();
 
+  std::string compressed;
+  auto data = maybeCompress(cborData, type, compressed);
+
   sendMessage(Cbor::encodeArray({
     requestId,
     type,
     command,
-    cborData,
+    data,
     timeout,
     (timestamp <= 0 ? requestStartTime : timestamp)
   }));
 }
 
 void Router::notify(int type, const std::string_view &command, const std::string_view &data) {
-  if (!socket) return;
+  if (!getSocket()) return;
+  std::string compressed;
+  int pktType = Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT;
+  auto payload = maybeCompress(data, pktType, compressed);
   auto buf = Cbor::encodeArray({
     -2,
-    Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT,
+    pktType,
     command,
-    data,
+    payload,
   });
-  sendMessage(buf);
+  sendMessage(std::move(buf));
+}
+
+void Router::notify(const Frame &frame, int mergeKey) {
+  sendMessage(frame, mergeKey);
+}
+
+// 广播用：只编码一次，之后各个Router直接共享这个包
+Router::Frame Router::encodeNotification(const std::string_view &command, const std::string_view &data) {
+  return std::make_shared<const std::string>(Cbor::encodeArray({
+    -2,
+    Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT,
+    command,
+    // 包体至少得传点东西，传个null吧
+    data == "" ? "\xF6" : data,
+  }));
 }
 
 // timeout永远是0
@@ -88,6 +113,11 @@ std::string Router::waitForReply(int timeout) {
   return m_reply;
 }
 
+void Router::waitForReply(int timeout, std::string &out) {
+  std::lock_guard<std::mutex> lock(replyMutex);
+  out.assign(m_reply);
+}
+
 void Router::abortRequest() {
   std::lock_guard<std::mutex> lock(replyMutex);
   m_reply = "";
@@ -123,13 +153,27 @@ void Router::handlePacket(const Packet &packet) {
   }
 }
 
-void Router::sendMessage(const std::string &msg) {
-  if (!socket) return;
-  // 将send任务交给主进程（如同Qt）并等待
-  auto &main_ctx = Server::instance().context();
-  auto f = asio::dispatch(main_ctx, asio::use_future([&, weak = socket->weak_from_this()] {
-    auto c = weak.lock();
-    if (c) c->send(std::make_shared<std::string>(msg));
-  }));
-  f.wait();
+void Router::sendMessage(std::string msg) {
+  // 在锁里拷一份shared_ptr，防止发送途中被主线程setSocket(nullptr)
+  auto s = getSocket();
+  if (!s) return;
+  // ClientSocket::send自带队列且线程安全，直接塞进去就走，不必等主线程
+  // 同一线程内的发送顺序由队列保证
+  s->send(std::make_shared<const std::string>(std::move(msg)));
+}
+
+std::string_view Router::maybeCompress(const std::string_view &data, int &type, std::string &buf) {
+  auto s = getSocket();
+  if (!s) return data;
+  auto compressor = s->compressor();
+  if (!compressor || !compressor->compress(data, buf)) return data;
+
+  type |= COMPRESSED;
+  return buf;
+}
+
+void Router::sendMessage(const Frame &frame, int mergeKey) {
+  auto s = getSocket();
+  if (!s) return;
+  s->send(frame, mergeKey);
 }
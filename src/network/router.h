@@ -17,7 +17,8 @@ public:
     SRC_LOBBY = 0x040,
     DEST_CLIENT = 0x001,
     DEST_SERVER = 0x002,
-    DEST_LOBBY = 0x004
+    DEST_LOBBY = 0x004,
+    COMPRESSED = 0x1000,       ///< data字段经过了raw deflate压缩，需要事先协商
   };
 
   enum RouterType {
@@ -25,6 +26,9 @@ public:
     TYPE_CLIENT
   };
 
+  // 编码完毕的整个消息包，不可变；广播时所有接收者共享同一份
+  using Frame = std::shared_ptr<const std::string>;
+
   Router() = delete;
   Router(Player *player, std::shared_ptr<ClientSocket> socket, RouterType type);
   ~Router();
@@ -39,7 +43,11 @@ public:
   void request(int type, const std::string_view &command,
               const std::string_view &cborData, int timeout, int64_t timestamp = -1);
   void notify(int type, const std::string_view &command, const std::string_view &cborData);
+  void notify(const Frame &frame, int mergeKey = 0);
+  static Frame encodeNotification(const std::string_view &command, const std::string_view &cborData);
   std::string waitForReply(int timeout);
+  // 写进out，out的容量可以反复用
+  void waitForReply(int timeout, std::string &out);
 
   void abortRequest();
 
@@ -47,7 +55,9 @@ protected:
   void handlePacket(const Packet &packet);
 
 private:
+  // 主线程setSocket，RoomThread里发消息时读，都要加锁
   std::shared_ptr<ClientSocket> socket;
+  mutable std::mutex socketMutex;
   Player *player = nullptr;
 
   RouterType type;
@@ -59,7 +69,10 @@ private:
   int expectedReplyId;
   int replyTimeout;
 
-  void sendMessage(const std::string &msg);
+  void sendMessage(std::string msg);
+  // 连接支持压缩且数据够大时压缩data，并在type上加COMPRESSED
+  std::string_view maybeCompress(const std::string_view &data, int &type, std::string &buf);
+  void sendMessage(const Frame &frame, int mergeKey = 0);
 
   // signals
   std::function<void()> reply_ready_callback;
@@ -2,6 +2,7 @@
 
 #include "network/server_socket.h"
 #include "network/client_socket.h"
+#include "network/io_pool.h"
 
 #include "server/server.h"
 #include "server/user/user_manager.h"
@@ -15,24 +16,64 @@ using asio::use_awaitable;
 using asio::redirect_error;
 
 ServerSocket::ServerSocket(asio::io_context &io_ctx, tcp::endpoint end, udp::endpoint udpEnd):
-  m_acceptor { io_ctx, end }, m_udp_socket { io_ctx, udpEnd }
+  m_acceptor { io_ctx, end }, m_udp_ctx { 1 }, m_udp_socket { m_udp_ctx, udpEnd }
 {
   spdlog::info("server is ready to listen on {}", end.port());
+  refreshDiscoveryInfo();
+}
+
+ServerSocket::~ServerSocket() {
+  stop();
 }
 
 void ServerSocket::start() {
   asio::co_spawn(m_acceptor.get_executor(), listener(), asio::detached);
-  asio::co_spawn(m_acceptor.get_executor(), udpListener(), asio::detached);
+  asio::co_spawn(m_udp_ctx, udpListener(), asio::detached);
+  m_udp_thread = std::thread([this] { m_udp_ctx.run(); });
+}
+
+void ServerSocket::stop() {
+  m_udp_ctx.stop();
+  if (m_udp_thread.joinable()) m_udp_thread.join();
+}
+
+void ServerSocket::refreshDiscoveryInfo() {
+  auto &conf = Server::instance().config();
+
+  cJSON *jsonArray = cJSON_CreateArray();
+  cJSON_AddItemToArray(jsonArray, cJSON_CreateString("0.5.14+"));
+  cJSON_AddItemToArray(jsonArray, cJSON_CreateString(conf.iconUrl.c_str()));
+  cJSON_AddItemToArray(jsonArray, cJSON_CreateString(conf.description.c_str()));
+  cJSON_AddItemToArray(jsonArray, cJSON_CreateNumber(conf.capacity));
+
+  char *json = cJSON_PrintUnformatted(jsonArray);
+  // 去掉末尾的']'，后面还要接在线人数和后缀
+  std::string prefix { json, strlen(json) - 1 };
+  prefix += ',';
+  cJSON_Delete(jsonArray);
+  free(json);
+
+  std::lock_guard<std::mutex> lock(m_detail_mutex);
+  m_detail_prefix = std::move(prefix);
+  m_udp_rate_limit = conf.udpRateLimit;
+  m_detail_version++;
+}
+
+void ServerSocket::setIoPool(IoContextPool *pool) {
+  m_io_pool = pool;
 }
 
 awaitable<void> ServerSocket::listener() {
   for (;;) {
     boost::system::error_code ec;
-    auto socket = co_await m_acceptor.async_accept(redirect_error(use_awaitable, ec));
+    tcp::socket socket { m_io_pool ? m_io_pool->next().get_executor() : m_acceptor.get_executor() };
+    co_await m_acceptor.async_accept(socket, redirect_error(use_awaitable, ec));
 
     if (!ec) {
       try {
         auto conn = std::make_shared<ClientSocket>(std::move(socket));
+        // 包的处理和断线都回到主线程来
+        conn->setHandlerExecutor(m_acceptor.get_executor());
 
         if (new_connection_callback) {
           new_connection_callback(conn);
@@ -47,37 +88,90 @@ awaitable<void> ServerSocket::listener() {
   }
 }
 
+// 把客户端带来的后缀转成JSON字符串
+static void appendJsonString(std::string &out, std::string_view sv) {
+  out += '"';
+  for (unsigned char c : sv) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      out += fmt::format("\\u{:04x}", c);
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+bool ServerSocket::udpAllowed(const asio::ip::address &addr) {
+  int rate = m_udp_rate_limit;
+  if (rate <= 0) return true;
+
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  // 允许攒两秒的量
+  double burst = rate * 2.0;
+
+  if (m_udp_buckets.size() > 4096) {
+    // 顺手清掉很久没来过的
+    std::erase_if(m_udp_buckets, [&](auto &kv) { return now - kv.second.last > 60s; });
+  }
+
+  auto [it, inserted] = m_udp_buckets.try_emplace(addr, TokenBucket { burst, now });
+  auto &bucket = it->second;
+  if (!inserted) {
+    auto elapsed = duration<double>(now - bucket.last).count();
+    bucket.tokens = std::min(burst, bucket.tokens + elapsed * rate);
+    bucket.last = now;
+  }
+
+  if (bucket.tokens < 1) return false;
+  bucket.tokens -= 1;
+  return true;
+}
+
 awaitable<void> ServerSocket::udpListener() {
+  auto &um = Server::instance().user_manager();
+
+  // 缓存的回复开头：前缀加上在线人数，只在配置或人数变化时重新拼
+  std::string head;
+  int cached_version = -1;
+  size_t cached_count = std::numeric_limits<size_t>::max();
+  std::string reply;
+
   for (;;) {
     auto buffer = asio::buffer(udp_recv_buffer);
     boost::system::error_code ec;
     auto len = co_await m_udp_socket.async_receive_from(
       buffer, udp_remote_end, redirect_error(use_awaitable, ec));
+    if (ec == asio::error::operation_aborted) break;
+    if (ec) continue;
+
+    if (!udpAllowed(udp_remote_end.address())) continue;
 
     auto sv = std::string_view { udp_recv_buffer.data(), len };
     // spdlog::debug("RX (udp [{}]:{}): {}", udp_remote_end.address().to_string(), udp_remote_end.port(), sv);
     if (sv == "fkDetectServer") {
-      m_udp_socket.async_send_to(
-        asio::const_buffer("me", 2), udp_remote_end, detached);
+      co_await m_udp_socket.async_send_to(
+        asio::const_buffer("me", 2), udp_remote_end, redirect_error(use_awaitable, ec));
     } else if (sv.starts_with("fkGetDetail,")) {
-      auto &conf = Server::instance().config();
-      auto &um = Server::instance().user_manager();
-
-      cJSON *jsonArray = cJSON_CreateArray();
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateString("0.5.14+"));
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateString(conf.iconUrl.c_str()));
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateString(conf.description.c_str()));
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateNumber(conf.capacity));
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateNumber(um.getPlayers().size()));
-      cJSON_AddItemToArray(jsonArray, cJSON_CreateString(std::string(sv).substr(12).c_str()));
-
-      char *json = cJSON_PrintUnformatted(jsonArray);
-      m_udp_socket.async_send_to(
-        asio::const_buffer(json, strlen(json)), udp_remote_end, detached);
-
-      // spdlog::debug("TX (udp [{}]:{}): {}", udp_remote_end.address().to_string(), udp_remote_end.port(), json);
-      cJSON_Delete(jsonArray);
-      free(json);
+      auto count = um.onlineCount();
+      if (cached_version != m_detail_version || cached_count != count) {
+        std::lock_guard<std::mutex> lock(m_detail_mutex);
+        cached_version = m_detail_version;
+        cached_count = count;
+        head = m_detail_prefix + std::to_string(count) + ',';
+      }
+
+      reply = head;
+      appendJsonString(reply, sv.substr(12));
+      reply += ']';
+
+      co_await m_udp_socket.async_send_to(
+        asio::buffer(reply), udp_remote_end, redirect_error(use_awaitable, ec));
+
+      // spdlog::debug("TX (udp [{}]:{}): {}", udp_remote_end.address().to_string(), udp_remote_end.port(), reply);
     }
   }
 }
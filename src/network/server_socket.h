@@ -3,6 +3,7 @@
 #pragma once
 
 class ClientSocket;
+class IoContextPool;
 
 class ServerSocket {
 public:
@@ -14,19 +15,47 @@ public:
   ServerSocket(ServerSocket &) = delete;
   ServerSocket(ServerSocket &&) = delete;
   ServerSocket(io_context &io_ctx, tcp::endpoint end, udp::endpoint udpEnd);
+  ~ServerSocket();
 
   void start();
+  void stop();
+
+  // 设置后新连接分摊到线程池的各个io_context上，否则都在主线程
+  void setIoPool(IoContextPool *pool);
+
+  // 根据当前配置重新生成fkGetDetail回复中不变的部分，配置重载后调用
+  void refreshDiscoveryInfo();
 
   // signal connectors
   void set_new_connection_callback(std::function<void(std::shared_ptr<ClientSocket>)>);
 
 private:
   tcp::acceptor m_acceptor;
+  IoContextPool *m_io_pool = nullptr;
+
+  // UDP探测请求在单独的线程里面处理，免得局域网扫描和列表爬虫刷爆主线程
+  io_context m_udp_ctx;
+  std::thread m_udp_thread;
   udp::socket m_udp_socket;
 
   udp::endpoint udp_remote_end;
   std::array<char, 128> udp_recv_buffer;
 
+  // fkGetDetail的回复除了在线人数和客户端带来的后缀以外都是固定的
+  // prefix由主线程生成，UDP线程读取
+  std::mutex m_detail_mutex;
+  std::string m_detail_prefix;
+  std::atomic<int> m_detail_version = 0;
+  std::atomic<int> m_udp_rate_limit = 0;
+
+  // 按来源IP限流用的令牌桶，只在UDP线程访问
+  struct TokenBucket {
+    double tokens;
+    std::chrono::steady_clock::time_point last;
+  };
+  std::map<boost::asio::ip::address, TokenBucket> m_udp_buckets;
+  bool udpAllowed(const boost::asio::ip::address &addr);
+
   // signals
   std::function<void(std::shared_ptr<ClientSocket>)> new_connection_callback;
 
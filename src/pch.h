@@ -11,6 +11,8 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <span>
+#include <bit>
 #include <list>
 #include <deque>
 #include <set>
@@ -11,9 +11,12 @@
 #include "server/room/lobby.h"
 #include "server/rpc-lua/rpc-lua.h"
 #include "server/gamelogic/roomthread.h"
+#include "network/client_socket.h"
+#include "network/router.h"
 #include "core/util.h"
 #include "core/c-wrapper.h"
 
+#include <cjson/cJSON.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <signal.h>
@@ -36,6 +39,7 @@ void Shell::helpCommand(StringList &) {
   HELP_MSG("{}: Shut down the server.", "quit");
   HELP_MSG("{}: Crash the server. Useful when encounter dead loop.", "crash");
   HELP_MSG("{}: View status of server.", "stat/gc");
+  HELP_MSG("{}: Show Lua RPC statistics, or on/off/reset/sample <n>/dump [file].", "rpcstat");
   HELP_MSG("{}: Reload server config file.", "reloadconf/r");
 
   spdlog::info("");
@@ -46,6 +50,7 @@ void Shell::helpCommand(StringList &) {
   HELP_MSG("{}: Broadcast message to a room.", "msgroom/mr");
   HELP_MSG("{}: Kick a player by his <id>.", "kick");
   HELP_MSG("{}: Kick all players in a room, then abandon it.", "killroom");
+  HELP_MSG("{}: Move room <id> to another RoomThread, or to [threadId].", "migrate");
   HELP_MSG("{}: Delete dead players in the lobby.", "checklobby");
 
   spdlog::info("");
@@ -721,20 +726,49 @@ void Shell::statCommand(StringList &) {
 
   auto players = server.user_manager().getPlayers();
   spdlog::info("Player(s) logged in: {}", players.size());
+
+  size_t max_queued = 0, slow_count = 0;
+  std::string slowest;
+  auto soft_limit = (size_t)server.config().outboundSoftLimit;
+  for (auto &[_, p] : players) {
+    auto socket = p->router().getSocket();
+    if (!socket) continue;
+    auto queued = socket->queuedBytes();
+    if (queued >= soft_limit) slow_count++;
+    if (queued > max_queued) {
+      max_queued = queued;
+      slowest = p->getScreenName();
+    }
+  }
+  spdlog::info("Outbound queue: {:.2f} KiB total, max {:.2f} KiB{}, {} over soft limit",
+               (double)ClientSocket::totalQueuedBytes() / 1024, (double)max_queued / 1024,
+               slowest.empty() ? "" : fmt::format(" ({})", slowest), slow_count);
+  spdlog::info("  {} frame(s) merged, {} dropped, {} connection(s) evicted",
+               ClientSocket::totalMergedFrames(), ClientSocket::totalDroppedFrames(),
+               ClientSocket::totalEvicted());
+  if (FrameCompressor::totalBytesIn() > 0) {
+    spdlog::info("Compression: {:.2f} KiB -> {:.2f} KiB ({:.1f}%)",
+                 (double)FrameCompressor::totalBytesIn() / 1024,
+                 (double)FrameCompressor::totalBytesOut() / 1024,
+                 100.0 * FrameCompressor::totalBytesOut() / FrameCompressor::totalBytesIn());
+  }
   // spdlog::info("Rooms: {}", server.room_manager().getRooms().size());
 
   auto &threads = server.getThreads();
   for (auto &[id, thr] : threads) {
     auto roomsCount = thr->getRefCount();
-    auto &L = thr->getLua();
-
-    auto stat_str = L.getConnectionInfo();
+    auto stat_str = thr->getConnectionInfo();
     auto outdated = thr->isOutdated();
     if (roomsCount == 0 && outdated) {
       server.removeThread(thr->id());
     } else {
       spdlog::info("RoomThread {} | {} | {} room(s) {}", id, stat_str, roomsCount,
             outdated ? "| Outdated" : "");
+      auto batch = thr->batchStats();
+      if (batch.batches > 0) {
+        spdlog::info("  {} request(s) in {} batch(es), avg {:.2f}, max {}", batch.requests,
+                     batch.batches, (double)batch.requests / batch.batches, batch.max_batch);
+      }
     }
   }
 
@@ -742,6 +776,110 @@ void Shell::statCommand(StringList &) {
         ((double)server.database().getMemUsage()) / 1048576);
 }
 
+static void printRpcStat(const RpcStats::Entry &e) {
+  auto &s = e.stats;
+  auto dir = e.direction == RpcStats::ToLua ? "->" : "<-";
+  if (s.sampled == 0) {
+    spdlog::info("  {} {}: {} call(s), {:.2f} KiB / {:.2f} KiB", dir, e.method, s.calls,
+                 (double)s.request_bytes / 1024, (double)s.response_bytes / 1024);
+    return;
+  }
+  spdlog::info("  {} {}: {} call(s), avg {:.3f} ms, p50 {:.3f} ms, p99 {:.3f} ms, max {:.3f} ms, "
+               "{:.2f} KiB / {:.2f} KiB", dir, e.method, s.calls,
+               (double)s.total_us / s.sampled / 1000, s.percentile(0.5) / 1000.0,
+               s.percentile(0.99) / 1000.0, s.max_us / 1000.0,
+               (double)s.request_bytes / 1024, (double)s.response_bytes / 1024);
+}
+
+static cJSON *rpcStatToJson(const RpcStats::Entry &e) {
+  auto &s = e.stats;
+  auto obj = cJSON_CreateObject();
+  cJSON_AddStringToObject(obj, "method", e.method.c_str());
+  cJSON_AddStringToObject(obj, "direction", e.direction == RpcStats::ToLua ? "toLua" : "fromLua");
+  cJSON_AddNumberToObject(obj, "calls", s.calls);
+  cJSON_AddNumberToObject(obj, "requestBytes", s.request_bytes);
+  cJSON_AddNumberToObject(obj, "responseBytes", s.response_bytes);
+  cJSON_AddNumberToObject(obj, "sampled", s.sampled);
+  cJSON_AddNumberToObject(obj, "totalUs", s.total_us);
+  cJSON_AddNumberToObject(obj, "maxUs", s.max_us);
+  cJSON_AddNumberToObject(obj, "p50Us", s.percentile(0.5));
+  cJSON_AddNumberToObject(obj, "p99Us", s.percentile(0.99));
+  auto buckets = cJSON_AddArrayToObject(obj, "buckets");
+  for (auto n : s.buckets) {
+    cJSON_AddItemToArray(buckets, cJSON_CreateNumber(n));
+  }
+  return obj;
+}
+
+void Shell::rpcstatCommand(StringList &list) {
+  auto &server = Server::instance();
+  auto sub = list.empty() ? "" : list[0];
+
+  if (sub == "on" || sub == "off") {
+    RpcStats::setEnabled(sub == "on");
+    spdlog::info("RPC statistics {}.", sub == "on" ? "enabled" : "disabled");
+    return;
+  } else if (sub == "sample") {
+    if (list.size() < 2) {
+      spdlog::info("Sampling latency of 1 in {} call(s).", RpcStats::sampleRate());
+      return;
+    }
+    RpcStats::setSampleRate(atoi(list[1].c_str()));
+    spdlog::info("Sampling latency of 1 in {} call(s).", RpcStats::sampleRate());
+    return;
+  } else if (sub == "reset") {
+    for (auto &[_, thr] : server.getThreads()) {
+      thr->rpcStats().reset();
+    }
+    spdlog::info("RPC statistics cleared.");
+    return;
+  } else if (sub == "dump") {
+    auto path = list.size() >= 2 ? list[1] : "rpcstat.json";
+    auto root = cJSON_CreateObject();
+    cJSON_AddBoolToObject(root, "enabled", RpcStats::enabled());
+    cJSON_AddNumberToObject(root, "sampleRate", RpcStats::sampleRate());
+    auto threads = cJSON_AddArrayToObject(root, "threads");
+    for (auto &[id, thr] : server.getThreads()) {
+      auto t = cJSON_CreateObject();
+      cJSON_AddNumberToObject(t, "id", id);
+      auto methods = cJSON_AddArrayToObject(t, "methods");
+      for (auto &e : thr->rpcStats().snapshot()) {
+        cJSON_AddItemToArray(methods, rpcStatToJson(e));
+      }
+      cJSON_AddItemToArray(threads, t);
+    }
+
+    auto json = cJSON_Print(root);
+    std::ofstream f { path };
+    f << json;
+    free(json);
+    cJSON_Delete(root);
+    if (!f) {
+      spdlog::warn("Cannot write {}", path);
+    } else {
+      spdlog::info("RPC statistics written to {}", path);
+    }
+    return;
+  } else if (!sub.empty()) {
+    spdlog::warn("Usage: rpcstat [on|off|reset|sample <n>|dump [file]]");
+    return;
+  }
+
+  spdlog::info("RPC statistics {}, sampling 1 in {} call(s). (-> we call Lua, <- Lua calls us)",
+               RpcStats::enabled() ? "on" : "off", RpcStats::sampleRate());
+  for (auto &[id, thr] : server.getThreads()) {
+    auto entries = thr->rpcStats().snapshot();
+    if (entries.empty()) continue;
+    std::sort(entries.begin(), entries.end(), [](auto &a, auto &b) {
+      return a.stats.calls > b.stats.calls;
+    });
+    spdlog::info("RoomThread {}:", id);
+    for (auto &e : entries) {
+      printRpcStat(e);
+    }
+  }
+}
+
 void Shell::killRoomCommand(StringList &list) {
   if (list.empty() || list[0].empty()) {
     spdlog::warn("Need room id to do this.");
@@ -768,6 +906,41 @@ void Shell::killRoomCommand(StringList &list) {
   }
 }
 
+void Shell::migrateCommand(StringList &list) {
+  if (list.empty() || list[0].empty()) {
+    spdlog::warn("Need room id to do this.");
+    return;
+  }
+
+  int roomId = atoi(list[0].c_str());
+  int threadId = list.size() >= 2 ? atoi(list[1].c_str()) : 0;
+  // 房间和线程都归主线程管
+  asio::post(Server::instance().context(), [roomId, threadId] {
+    auto &server = Server::instance();
+    auto room = server.room_manager().findRoom(roomId).lock();
+    if (!room) {
+      spdlog::info("No such room.");
+      return;
+    }
+
+    RoomThread *target = nullptr;
+    if (threadId != 0) {
+      target = server.getThread(threadId).lock().get();
+      if (!target) {
+        spdlog::info("No such thread.");
+        return;
+      }
+    } else {
+      target = server.pickThread(room->thread().lock().get());
+      if (!target) target = &server.createThread();
+    }
+
+    if (!room->migrateTo(*target)) {
+      spdlog::warn("Cannot migrate room {} to thread {}.", roomId, target->id());
+    }
+  });
+}
+
 void Shell::checkLobbyCommand(StringList &) {
   auto &server = Server::instance();
   auto lobby = server.room_manager().lobby().lock();
@@ -830,7 +1003,9 @@ Shell::Shell() {
     {"rp", &Shell::resetPasswordCommand},
     {"stat", &Shell::statCommand},
     {"gc", &Shell::statCommand},
+    {"rpcstat", &Shell::rpcstatCommand},
     {"killroom", &Shell::killRoomCommand},
+    {"migrate", &Shell::migrateCommand},
     {"checklobby", &Shell::checkLobbyCommand},
     // special command
     {"quit", &Shell::helpCommand},
@@ -48,7 +48,9 @@ private:
   void reloadConfCommand(StringList &);
   void resetPasswordCommand(StringList &);
   void statCommand(StringList &);
+  void rpcstatCommand(StringList &);
   void killRoomCommand(StringList &);
+  void migrateCommand(StringList &);
   void checkLobbyCommand(StringList &);
 
 private:
@@ -11,6 +11,9 @@
 #include "server/room/room_manager.h"
 #include "server/room/room.h"
 #include "server/rpc-lua/rpc-lua.h"
+#ifdef FK_EMBED_LUA
+#include "server/rpc-lua/native-lua.h"
+#endif
 
 #include <spdlog/spdlog.h>
 #include <sys/eventfd.h>
@@ -28,11 +31,25 @@ RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
 
   auto &server = Server::instance();
   m_capacity = server.config().roomCountPerThread;
+  m_checkpoint_timer = std::make_unique<asio::steady_timer>(main_ctx);
+  // 计时器回调要拿weak_from_this，构造函数里还拿不到，等主线程把自己放进m_threads之后再开始
+  asio::post(main_ctx, [id = m_id] {
+    if (auto t = Server::instance().getThread(id).lock()) t->scheduleCheckpoint();
+  });
   md5 = server.getMd5();
+  m_batch_size = std::max(server.config().luaBatchSize, 1);
+  m_batch_delay = server.config().luaBatchDelay;
+  m_batch_timer = std::make_unique<asio::steady_timer>(io_ctx);
+  m_timers = std::make_unique<TimerWheel>(io_ctx, [this](auto expired) {
+    resumeRooms(expired);
+  });
 
-  // 在run中创建，这样就能在接下来的exec中处理事件了
-  // 这集可以直接在构造函数创了 Qt故事里面是为了绑定到新线程对应的eventLoop
-  L = std::make_unique<RpcLua>(io_ctx);
+  // fork lua5.4并等它加载完freekill-core要好一会儿，放到自己的线程里做，
+  // 这样主线程不会卡住；在此之前进来的请求按顺序排在后面
+  // 配置只在主线程里读，reloadconf随时会把它换掉
+  asio::post(io_ctx, [this, mode = server.config().luaMode, shm = server.config().luaShmRingSize] {
+    initLua(mode, shm);
+  });
 
   push_request_callback = [&](const std::string msg) {
     // spdlog::debug("--> PushRequest {}" , msg);
@@ -40,32 +57,24 @@ RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
   };
   delay_callback = [&](int roomId, int ms) {
     // spdlog::debug("--> Delay {} {}", roomId, ms);
-    auto timer = std::make_shared<asio::steady_timer>(io_ctx, std::chrono::milliseconds(ms));
-    timer->async_wait([weak = weak_from_this(), roomId, timer](const std::error_code& ec){
-      if (!ec) {
-        auto t = weak.lock();
-        if (!t) return;
-        t->L->call("ResumeRoom", roomId, "delay_done"sv);
-      } else {
-        spdlog::error("error in delay(): {}", ec.message());
-      }
-    });
+    addTimer(roomId, ms, "delay_done");
   };
   wake_up_callback = [&](int roomId, const char *reason) {
     // spdlog::debug("--> ResumeRoom {} {}", roomId, reason);
     L->call("ResumeRoom", roomId, std::string_view { reason });
   };
 
+  // 下面这几个不需要返回值，发出去就不管了，返回值在之后顺带处理
   set_player_state_callback = [&](int connId, int pid, int roomId) {
     auto &um = Server::instance().user_manager();
     auto p = um.findPlayerByConnId(connId).lock();
     if (!p) {
-      L->call("SetPlayerState", roomId, pid, Player::Offline);
+      L->callAsync("SetPlayerState", nullptr, roomId, pid, Player::Offline);
       return;
     }
 
     // spdlog::debug("--> SetPlayerState {}, {}, {}, {}", roomId, connId, p->getId(), p->getStateString());
-    L->call("SetPlayerState", roomId, p->getId(), p->getState());
+    L->callAsync("SetPlayerState", nullptr, roomId, p->getId(), p->getState());
   };
   add_observer_callback = [&](int connId, int roomId) {
     auto &um = Server::instance().user_manager();
@@ -73,17 +82,158 @@ RoomThread::RoomThread(asio::io_context &main_ctx) : io_ctx {},
     if (!p) return;
 
     // spdlog::debug("--> AddObserver {}, {}, {}", roomId, connId, p->getId());
-    L->call("AddObserver", roomId, RpcDispatchers::getPlayerObject(*p));
+    L->callAsync("AddObserver", nullptr, roomId, RpcDispatchers::getPlayerObject(*p));
   };
   remove_observer_callback = [&](int pid, int roomId) {
     // spdlog::debug("--> RemoveObserver {}, {}", roomId, pid);
-    L->call("RemoveObserver", roomId, pid);
+    L->callAsync("RemoveObserver", nullptr, roomId, pid);
   };
 
   start();
 }
 
+void RoomThread::initLua(const std::string &mode, int shm_ring_size) {
+  try {
+#ifdef FK_EMBED_LUA
+    if (mode == "embedded") {
+      L = std::make_unique<NativeLua>(io_ctx, m_rpc_stats);
+    }
+#else
+    if (mode == "embedded") {
+      spdlog::warn("luaMode \"embedded\" needs a build with FK_EMBED_LUA=ON, using a Lua process instead.");
+    }
+#endif
+    if (!L) {
+      L = std::make_unique<RpcLua>(io_ctx, m_rpc_stats, shm_ring_size);
+    }
+  } catch (const std::exception &e) {
+    spdlog::error("Cannot start Lua for thread {}: {}", m_id, e.what());
+    L = nullptr;
+    // 这时主线程可能还没把自己放进m_threads，按id去找
+    asio::post(Server::instance().context(), [id = m_id] {
+      if (auto t = Server::instance().getThread(id).lock()) t->shutdown();
+    });
+    return;
+  }
+
+  // Lua挂掉时主动通知主线程，而不是等下一次发消息才发现
+  L->setDiedCallback([this] { requestRecover(); });
+  m_ready = true;
+}
+
+void RoomThread::requestRecover() {
+  asio::post(Server::instance().context(), [id = m_id] {
+    if (auto t = Server::instance().getThread(id).lock()) t->recover();
+  });
+}
+
+void RoomThread::recover() {
+  // 已经在重启了，或者Lua本来就还没起来
+  if (!m_ready) return;
+
+  spdlog::error("Lua is not working ({}) in thread {}.", L->getConnectionInfo(), m_id);
+
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  std::erase_if(m_respawn_times, [&](auto t) { return now - t > minutes(respawn_window_min); });
+  if (isOutdated() || (int)m_respawn_times.size() >= max_respawns) {
+    // 过期了的线程没必要再救；短时间内反复崩溃的话多半是Lua本身有问题，别没完没了
+    spdlog::error("Shutting down thread {}.", m_id);
+    shutdown();
+    return;
+  }
+  m_respawn_times.push_back(now);
+  m_ready = false;
+
+  // 没开打的房间Lua还不知道，原样留着；开打的有这一局的存档就在新Lua里接着跑，没有就只能关掉
+  auto &rm = Server::instance().room_manager();
+  std::vector<std::pair<int, std::string>> restore;
+  auto rooms = m_rooms;
+  for (auto roomId : rooms) {
+    auto room = rm.findRoom(roomId).lock();
+    if (!room || !room->isStarted()) continue;
+
+    auto state = room->getCheckpoint();
+    if (!state.empty()) {
+      restore.emplace_back(roomId, std::string { state });
+    } else {
+      room->abortByLuaError();
+    }
+  }
+  spdlog::info("Restarting Lua in thread {}, restoring {} started room(s)", m_id, restore.size());
+
+  auto &conf = Server::instance().config();
+  asio::post(io_ctx, [this, mode = conf.luaMode, shm = conf.luaShmRingSize, restore = std::move(restore)] {
+    // 旧Lua设的计时器作废，恢复的房间下面统一叫醒一次
+    m_timers->clear();
+    // 我们正跑在io_ctx的回调里，旧Lua可能还有回调排在后面；先让它们失效，下一轮再析构
+    std::unique_ptr<LuaInterface> old = std::move(L);
+    old->detach();
+    asio::post(io_ctx, [old = std::move(old)] {});
+    initLua(mode, shm);
+    if (!m_ready) return;
+
+    for (auto &[roomId, state] : restore) {
+      // 回调在本线程里跑；导入成功了才叫醒，不然新Lua里根本没有这个房间
+      L->callAsync("ImportRoom", [this, roomId](const JsonRpc::JsonRpcPacket &pkt) {
+        if (pkt.error.code == 0) {
+          L->call("ResumeRoom", roomId, "restored"sv);
+          return;
+        }
+        asio::post(Server::instance().context(), [roomId] {
+          auto room = Server::instance().room_manager().findRoom(roomId).lock();
+          if (room) room->abortByLuaError();
+        });
+      }, roomId, std::string_view { state });
+    }
+    // 重启期间攒下的请求和信号
+    flushMailbox();
+  });
+}
+
+void RoomThread::scheduleCheckpoint() {
+  auto interval = Server::instance().config().luaCheckpointInterval;
+  // 关着的时候也隔一会儿看一眼配置
+  m_checkpoint_timer->expires_after(std::chrono::seconds(interval > 0 ? interval : 60));
+  // cancel()之前已经排进队列的回调还是会带着成功的ec跑，所以不能捕获this
+  m_checkpoint_timer->async_wait([weak = weak_from_this()](const boost::system::error_code &ec) {
+    auto t = weak.lock();
+    if (ec || !t) return;
+    if (Server::instance().config().luaCheckpointInterval > 0) t->checkpointRooms();
+    t->scheduleCheckpoint();
+  });
+}
+
+void RoomThread::checkpointRooms() {
+  if (!m_ready || !m_checkpoint_supported) return;
+
+  auto &rm = Server::instance().room_manager();
+  for (auto roomId : m_rooms) {
+    auto room = rm.findRoom(roomId).lock();
+    if (!room || !room->isStarted() || room->isMigrating()) continue;
+
+    auto session = room->getSessionId();
+    emit_signal([=, this] {
+      L->callAsync("SnapshotRoom", [=, this](const JsonRpc::JsonRpcPacket &pkt) {
+        if (pkt.error.code == -32601) {
+          if (m_checkpoint_supported.exchange(false)) {
+            spdlog::info("Lua in thread {} does not support room checkpoints", m_id);
+          }
+          return;
+        }
+        auto state = std::get_if<std::string_view>(&pkt.result);
+        if (pkt.error.code != 0 || !state) return;
+        asio::post(Server::instance().context(), [roomId, session, state = std::string { *state }]() mutable {
+          auto room = Server::instance().room_manager().findRoom(roomId).lock();
+          if (room) room->setCheckpoint(session, std::move(state));
+        });
+      }, roomId);
+    });
+  }
+}
+
 RoomThread::~RoomThread() {
+  m_checkpoint_timer->cancel();
   io_ctx.stop();
   m_thread.join();
   // spdlog::debug("[MEMORY] RoomThread {} destructed", m_id);
@@ -126,31 +276,206 @@ void RoomThread::shutdown() {
   md5 = ""; // outdated = true;
 
   auto &rm = Server::instance().room_manager();
-  for (auto roomId : m_rooms) {
+  // removeRoom会析构Room，Room的析构函数又会修改m_rooms，所以遍历副本
+  auto rooms = m_rooms;
+  for (auto roomId : rooms) {
     auto room = rm.findRoom(roomId).lock();
     if (!room) continue;
-
-    // 无论如何都减一下 因为Lua肯定不存在了
-    room->decreaseRefCount();
-
-    room->setOutdated();
-    room->doBroadcastNotify(room->getPlayers(), "ErrorDlg", "Server Internal Error");
-    rm.removeRoom(roomId);
+    room->abortByLuaError();
   }
 }
 
 void RoomThread::emit_signal(std::function<void()> f) {
-  if (!L->alive()) {
-    spdlog::error("Lua is not working ({}). Shutting down thread {}.", L->getConnectionInfo(), m_id);
-    shutdown();
+  if (m_ready && !L->alive()) {
+    // 重启Lua，这个信号排在后面等新的Lua处理
+    if (Server::instance().context().get_executor().running_in_this_thread()) {
+      recover();
+    } else {
+      requestRecover();
+    }
+  }
+
+  // 本来就在Lua线程里的话照旧直接执行
+  if (m_ready && io_ctx.get_executor().running_in_this_thread()) {
+    f();
     return;
   }
 
-  asio::dispatch(io_ctx, f);
+  postMail({ {}, std::move(f) });
 }
 
 void RoomThread::pushRequest(const std::string &req) {
-  emit_signal([=, this] { push_request_callback(req); });
+  if (m_ready && (!L->alive() || io_ctx.get_executor().running_in_this_thread())) {
+    // Lua挂了要走重启的流程，在Lua线程里则照旧直接执行
+    emit_signal([=, this] { push_request_callback(req); });
+    return;
+  }
+
+  postMail({ req, nullptr });
+}
+
+void RoomThread::postMail(Mail &&mail) {
+  std::lock_guard lock { m_mail_mutex };
+  m_mailbox.push_back(std::move(mail));
+
+  if (m_flush_scheduled) {
+    // 攒够一批就别等计时器了
+    if (m_batch_delay > 0 && m_mailbox.size() == m_batch_size) {
+      asio::post(io_ctx, [this] { flushMailbox(); });
+    }
+    return;
+  }
+
+  m_flush_scheduled = true;
+  if (m_batch_delay <= 0) {
+    asio::post(io_ctx, [this] { flushMailbox(); });
+  } else {
+    asio::post(io_ctx, [this] {
+      m_batch_timer->expires_after(std::chrono::milliseconds(m_batch_delay));
+      m_batch_timer->async_wait([this](const boost::system::error_code &ec) {
+        if (!ec) flushMailbox();
+      });
+    });
+  }
+}
+
+void RoomThread::flushMailbox() {
+  std::vector<Mail> mails;
+  {
+    std::lock_guard lock { m_mail_mutex };
+    mails.swap(m_mailbox);
+    m_flush_scheduled = false;
+  }
+  // Lua还没起来或者正在重启，先留在信箱里，起来之后会再flush一次
+  if (!m_ready) {
+    std::lock_guard lock { m_mail_mutex };
+    mails.insert(mails.end(), std::make_move_iterator(m_mailbox.begin()),
+                 std::make_move_iterator(m_mailbox.end()));
+    m_mailbox.swap(mails);
+    return;
+  }
+  if (mails.empty()) return;
+  m_in_flight = mails.size();
+
+  // 保持原来的顺序：遇到信号就先把前面攒的请求发掉
+  std::vector<std::string_view> batch;
+  for (auto &mail : mails) {
+    if (mail.signal) {
+      deliverRequests(batch);
+      mail.signal();
+      continue;
+    }
+
+    batch.push_back(mail.request);
+    if (batch.size() >= m_batch_size) {
+      deliverRequests(batch);
+    }
+  }
+  deliverRequests(batch);
+  m_in_flight = 0;
+}
+
+void RoomThread::deliverRequests(std::vector<std::string_view> &batch) {
+  if (batch.empty()) return;
+
+  m_stat_batches++;
+  m_stat_requests += batch.size();
+  auto max_batch = m_stat_max_batch.load();
+  while (batch.size() > max_batch && !m_stat_max_batch.compare_exchange_weak(max_batch, batch.size()));
+
+  if (batch.size() > 1 && m_batch_supported) {
+    L->call("HandleRequests", std::span<const std::string_view> { batch });
+    if (L->lastError() != -32601) {
+      batch.clear();
+      return;
+    }
+
+    spdlog::info("Lua in thread {} does not support HandleRequests, sending requests one by one", m_id);
+    m_batch_supported = false;
+  }
+
+  for (auto req : batch) {
+    L->call("HandleRequest", req);
+  }
+  batch.clear();
+}
+
+void RoomThread::resumeRooms(std::span<const TimerWheel::Expired> expired) {
+  // Lua正在重启的话不用管，恢复的房间会收到restored
+  if (!m_ready || !L->alive()) return;
+
+  if (expired.size() > 1 && m_resume_batch_supported) {
+    if (m_resume_args.size() < expired.size()) m_resume_args.resize(expired.size());
+    auto &batch = m_resume_views;
+    batch.clear();
+    for (size_t i = 0; i < expired.size(); i++) {
+      auto &arg = m_resume_args[i];
+      arg.clear();
+      fmt::format_to(std::back_inserter(arg), "{},{}", expired[i].roomId, expired[i].reason);
+      batch.push_back(arg);
+    }
+
+    L->call("ResumeRooms", std::span<const std::string_view> { batch });
+    batch.clear();
+    if (L->lastError() != -32601) return;
+
+    spdlog::info("Lua in thread {} does not support ResumeRooms, resuming rooms one by one", m_id);
+    m_resume_batch_supported = false;
+  }
+
+  for (auto &e : expired) {
+    L->call("ResumeRoom", e.roomId, std::string_view { e.reason });
+  }
+}
+
+auto RoomThread::batchStats() const -> BatchStats {
+  return { m_stat_batches.load(), m_stat_requests.load(), m_stat_max_batch.load() };
+}
+
+uint64_t RoomThread::cpuTimeUs() const {
+  uint64_t ret = 0;
+  clockid_t cid;
+  timespec ts;
+  if (pthread_getcpuclockid(const_cast<std::thread &>(m_thread).native_handle(), &cid) == 0 &&
+      clock_gettime(cid, &ts) == 0) {
+    ret = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+  if (m_ready) ret += L->cpuTimeUs();
+  return ret;
+}
+
+void RoomThread::sampleLoad() {
+  using namespace std::chrono;
+  auto now = steady_clock::now();
+  auto elapsed = duration_cast<microseconds>(now - m_load_sampled_at).count();
+  auto cpu = cpuTimeUs();
+  // Lua重启之后进程的CPU时间从头算，这一次就跳过
+  if (m_last_cpu_us > 0 && cpu >= m_last_cpu_us && elapsed > 0) {
+    auto current = 100.0 * (cpu - m_last_cpu_us) / elapsed;
+    // 新旧各占一半，几次采样之后旧的负载就淡出了，又不至于被一次抖动带跑
+    m_cpu_percent = m_cpu_sampled ? (m_cpu_percent + current) / 2 : current;
+    m_cpu_sampled = true;
+  }
+  m_last_cpu_us = cpu;
+  m_load_sampled_at = now;
+}
+
+auto RoomThread::load() -> Load {
+  size_t queued;
+  {
+    std::lock_guard lock { m_mail_mutex };
+    queued = m_mailbox.size();
+  }
+  queued += m_in_flight;
+
+  auto &rm = Server::instance().room_manager();
+  int started = 0;
+  for (auto roomId : m_rooms) {
+    auto room = rm.findRoom(roomId).lock();
+    if (room && room->isStarted()) started++;
+  }
+
+  return { m_cpu_percent, queued, started };
 }
 
 void RoomThread::delay(int roomId, int ms) {
@@ -161,6 +486,19 @@ void RoomThread::wakeUp(int roomId, const char *reason) {
   emit_signal([=, this] { wake_up_callback(roomId, reason); });
 }
 
+auto RoomThread::addTimer(int roomId, int ms, const char *reason) -> TimerWheel::Handle {
+  return m_timers->arm(ms, roomId, reason);
+}
+
+void RoomThread::cancelTimer(TimerWheel::Handle h) {
+  if (h == 0) return;
+  if (io_ctx.get_executor().running_in_this_thread()) {
+    m_timers->cancel(h);
+    return;
+  }
+  asio::post(io_ctx, [this, h] { m_timers->cancel(h); });
+}
+
 void RoomThread::setPlayerState(int connId, int pid, int roomId) {
   emit_signal([=, this] { set_player_state_callback(connId, pid, roomId); });
 }
@@ -173,8 +511,20 @@ void RoomThread::removeObserver(int pid, int roomId) {
   emit_signal([=, this] { remove_observer_callback(pid, roomId); });
 }
 
-const RpcLua &RoomThread::getLua() const {
-  return *L;
+bool RoomThread::isReady() const {
+  return m_ready;
+}
+
+std::string RoomThread::getConnectionInfo() {
+  // L只在主线程把m_ready置false之后才会被换掉，所以在主线程里看是安全的
+  auto f = asio::dispatch(Server::instance().context(), asio::use_future([self = shared_from_this()] {
+    return self->m_ready ? self->L->getConnectionInfo() : std::string { "starting Lua" };
+  }));
+  return f.get();
+}
+
+RpcStats &RoomThread::rpcStats() {
+  return m_rpc_stats;
 }
 
 bool RoomThread::isFull() const {
@@ -223,3 +573,38 @@ void RoomThread::removeRoom(int roomId) {
     m_rooms.erase(it);
   }
 }
+
+const std::vector<int> &RoomThread::getRooms() const {
+  return m_rooms;
+}
+
+// 信箱是按顺序处理的，到这里时Lua肯定不在处理这个房间的请求中途
+void RoomThread::exportRoom(int roomId, std::function<void(bool, std::string)> done) {
+  emit_signal([=, this] {
+    L->callAsync("ExportRoom", [=, this](const JsonRpc::JsonRpcPacket &pkt) {
+      auto state = std::get_if<std::string_view>(&pkt.result);
+      bool ok = pkt.error.code == 0 && state;
+      if (pkt.error.code == -32601) {
+        spdlog::info("Lua in thread {} does not support room migration", m_id);
+        m_migration_supported = false;
+      }
+      asio::post(Server::instance().context(),
+                 [done, ok, state = ok ? std::string { *state } : std::string {}]() mutable {
+        done(ok, std::move(state));
+      });
+    }, roomId);
+  });
+}
+
+void RoomThread::importRoom(int roomId, std::string state, std::function<void(bool)> done) {
+  emit_signal([=, this] {
+    L->callAsync("ImportRoom", [=](const JsonRpc::JsonRpcPacket &pkt) {
+      bool ok = pkt.error.code == 0;
+      asio::post(Server::instance().context(), [done, ok] { done(ok); });
+    }, roomId, std::string_view { state });
+  });
+}
+
+bool RoomThread::supportsMigration() const {
+  return m_migration_supported;
+}
@@ -2,8 +2,11 @@
 
 #pragma once
 
+#include "server/gamelogic/timer-wheel.h"
+#include "server/rpc-lua/rpc-stats.h"
+
 class Room;
-class RpcLua;
+class LuaInterface;
 
 class RoomThread : public std::enable_shared_from_this<RoomThread> {
 public:
@@ -24,11 +27,21 @@ public:
   void delay(int roomId, int ms);
   void wakeUp(int roomId, const char *reason);
 
+  // 房间的计时器都挂在线程自己的时间轮上，到期后ResumeRoom(roomId, reason)
+  // addTimer只能在RoomThread自己的线程里调用（Lua调过来的时候就是），cancelTimer哪里都行
+  TimerWheel::Handle addTimer(int roomId, int ms, const char *reason);
+  void cancelTimer(TimerWheel::Handle h);
+
   void setPlayerState(int connId, int pid, int roomId);
   void addObserver(int connId, int roomId);
   void removeObserver(int pid, int roomId);
 
-  const RpcLua &getLua() const;
+  // Lua在RoomThread自己的线程里启动，启动完之前发来的请求和信号都在信箱里排队
+  bool isReady() const;
+  // 给shell线程用，到主线程里去读，免得正好碰上Lua重启
+  std::string getConnectionInfo();
+  // Lua调用统计，有锁，哪个线程都能读；Lua重启了也不清零
+  RpcStats &rpcStats();
 
   bool isFull() const;
 
@@ -43,6 +56,32 @@ public:
 
   void addRoom(int roomId);
   void removeRoom(int roomId);
+  const std::vector<int> &getRooms() const;
+
+  // 迁移开打了的房间用：旧Lua用ExportRoom导出房间状态并放弃这个房间，新Lua用ImportRoom接手
+  // done在主线程里调用；Lua出错或者不支持时ok为false
+  void exportRoom(int roomId, std::function<void(bool ok, std::string state)> done);
+  void importRoom(int roomId, std::string state, std::function<void(bool ok)> done);
+  // Lua不认识ExportRoom之后就是false，再迁移也没用
+  bool supportsMigration() const;
+
+  // HandleRequest批处理的统计：批次数、请求数、最大批大小
+  struct BatchStats {
+    uint64_t batches;
+    uint64_t requests;
+    uint64_t max_batch;
+  };
+  BatchStats batchStats() const;
+
+  // 分配房间时参考的负载，只在主线程里调用
+  struct Load {
+    double cpu_percent;   // RoomThread线程加上Lua进程，最近一段时间的衰减平均
+    size_t queued;        // 信箱里排队和正在交给Lua处理的请求、信号
+    int started_rooms;
+  };
+  Load load();
+  // 由Server每隔几秒调一次，更新load()里的CPU占用
+  void sampleLoad();
 
 private:
   int m_id = 0;
@@ -53,7 +92,24 @@ private:
 
   std::vector<int> m_rooms;
 
-  std::unique_ptr<RpcLua> L;
+  RpcStats m_rpc_stats;
+  std::unique_ptr<LuaInterface> L;
+  std::atomic<bool> m_ready = false;
+  // 在RoomThread线程里调用，用到的配置项由主线程读好传进来
+  void initLua(const std::string &mode, int shm_ring_size);
+
+  // Lua挂了就在同一个线程里重新启动一个，开打的房间从存档恢复；
+  // respawn_window_min分钟内重启超过max_respawns次就放弃，整个线程关掉
+  enum { max_respawns = 3, respawn_window_min = 10 };
+  std::vector<std::chrono::steady_clock::time_point> m_respawn_times;
+  void recover();         // 主线程
+  void requestRecover();  // 任意线程，转到主线程调recover
+
+  // 每隔luaCheckpointInterval秒让Lua给开打的房间存个档（SnapshotRoom），计时器在主线程上
+  std::unique_ptr<boost::asio::steady_timer> m_checkpoint_timer;
+  std::atomic<bool> m_checkpoint_supported = true;
+  void scheduleCheckpoint();
+  void checkpointRooms();
 
   void start();
   void shutdown();
@@ -68,6 +124,42 @@ private:
 
   void emit_signal(std::function<void()> f);
 
+  // 主线程发来的请求和信号先按顺序放进信箱，Lua线程醒来一次全取走；
+  // 连续的请求合成一次HandleRequests发给Lua
+  struct Mail {
+    std::string request;
+    std::function<void()> signal; // 为空表示这是个request
+  };
+  std::mutex m_mail_mutex;
+  std::vector<Mail> m_mailbox;
+  bool m_flush_scheduled = false;
+  void postMail(Mail &&mail);
+  void flushMailbox();
+  void deliverRequests(std::vector<std::string_view> &batch);
+
+  // 同一格里到期的计时器合成一次ResumeRooms，参数是"roomId,reason"组成的数组
+  std::unique_ptr<TimerWheel> m_timers;
+  bool m_resume_batch_supported = true; // Lua不认识ResumeRooms的话就一个个ResumeRoom
+  std::vector<std::string> m_resume_args;
+  std::vector<std::string_view> m_resume_views;
+  void resumeRooms(std::span<const TimerWheel::Expired> expired);
+
+  size_t m_batch_size;
+  int m_batch_delay;
+  bool m_batch_supported = true; // Lua不认识HandleRequests的话就一条条发
+  std::atomic<bool> m_migration_supported = true;
+  std::unique_ptr<boost::asio::steady_timer> m_batch_timer;
+  std::atomic<uint64_t> m_stat_batches = 0;
+  std::atomic<uint64_t> m_stat_requests = 0;
+  std::atomic<uint64_t> m_stat_max_batch = 0;
+  std::atomic<size_t> m_in_flight = 0;
+
+  uint64_t cpuTimeUs() const;
+  std::chrono::steady_clock::time_point m_load_sampled_at;
+  uint64_t m_last_cpu_us = 0;
+  double m_cpu_percent = 0;
+  bool m_cpu_sampled = false;
+
   int m_capacity;
   // 为什么不直接用智能指针呢，算了，这个值表示当前引用它的房间数量
   int m_ref_count = 0;
@@ -15,41 +15,54 @@ using _rpcRet = std::pair<bool, JsonRpcParam>;
 
 static JsonRpcParam nullVal;
 
-// part1: stdout相关
+// 下面的函数直接写成带类型的形参，由typed<>在编译期生成解包代码：
+// 参数个数和每个参数的类型都对得上才调用，否则就是invalid_params
+template <typename F>
+struct RpcUnpacker;
+
+template <typename... Args>
+struct RpcUnpacker<_rpcRet (*)(Args...)> {
+  template <auto Fn>
+  static _rpcRet call(const JsonRpcPacket &packet) {
+    if (packet.param_count != sizeof...(Args)) {
+      return { false, nullVal };
+    }
 
-static _rpcRet _rpc_qDebug(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 && std::holds_alternative<std::string_view>(packet.param1) )) {
-    return { false, nullVal };
+    const JsonRpcParam *params[] = {
+      &packet.param1, &packet.param2, &packet.param3, &packet.param4, &packet.param5,
+    };
+    return [&]<size_t... I>(std::index_sequence<I...>) -> _rpcRet {
+      std::tuple<const Args *...> values { std::get_if<Args>(params[I])... };
+      if (((std::get<I>(values) == nullptr) || ...)) {
+        return { false, nullVal };
+      }
+      return Fn(*std::get<I>(values)...);
+    }(std::index_sequence_for<Args...> {});
   }
+};
 
-  spdlog::debug("{}", std::get<std::string_view>(packet.param1));
-  return { true, nullVal };
-}
+template <auto Fn>
+constexpr RpcMethod typed = &RpcUnpacker<decltype(Fn)>::template call<Fn>;
 
-static _rpcRet _rpc_qInfo(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 && std::holds_alternative<std::string_view>(packet.param1) )) {
-    return { false, nullVal };
-  }
+// part1: stdout相关
 
-  spdlog::info("{}", std::get<std::string_view>(packet.param1));
+static _rpcRet _rpc_qDebug(std::string_view msg) {
+  spdlog::debug("{}", msg);
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_qWarning(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 && std::holds_alternative<std::string_view>(packet.param1) )) {
-    return { false, nullVal };
-  }
-
-  spdlog::warn("{}", std::get<std::string_view>(packet.param1));
+static _rpcRet _rpc_qInfo(std::string_view msg) {
+  spdlog::info("{}", msg);
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_qCritical(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 && std::holds_alternative<std::string_view>(packet.param1) )) {
-    return { false, nullVal };
-  }
+static _rpcRet _rpc_qWarning(std::string_view msg) {
+  spdlog::warn("{}", msg);
+  return { true, nullVal };
+}
 
-  spdlog::error("{}", std::get<std::string_view>(packet.param1));
+static _rpcRet _rpc_qCritical(std::string_view msg) {
+  spdlog::error("{}", msg);
   return { true, nullVal };
 }
 
@@ -79,23 +92,8 @@ static _rpcRet _rpc_print(const JsonRpcPacket &packet) {
 
 // part2: Player相关
 
-static _rpcRet _rpc_Player_doRequest(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 5 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2) &&
-    std::holds_alternative<std::string_view>(packet.param3) &&
-    std::holds_alternative<int>(packet.param4) &&
-    std::holds_alternative<int64_t>(packet.param5)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto command = std::get<std::string_view>(packet.param2);
-  auto jsonData = std::get<std::string_view>(packet.param3);
-  auto timeout = std::get<int>(packet.param4);
-  int64_t timestamp = std::get<int64_t>(packet.param5);
-
+static _rpcRet _rpc_Player_doRequest(int connId, std::string_view command, std::string_view jsonData,
+                                     int timeout, int64_t timestamp) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -106,39 +104,18 @@ static _rpcRet _rpc_Player_doRequest(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_waitForReply(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<int>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto timeout = std::get<int>(packet.param2);
-
+static _rpcRet _rpc_Player_waitForReply(int connId, int timeout) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
   }
 
-  auto reply = player->waitForReply(timeout);
-  return { true, reply };
+  auto &reply = resultBuffer();
+  player->waitForReply(timeout, reply);
+  return { true, std::string_view { reply } };
 }
 
-static _rpcRet _rpc_Player_doNotify(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 3 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2) &&
-    std::holds_alternative<std::string_view>(packet.param3)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto command = std::get<std::string_view>(packet.param2);
-  auto jsonData = std::get<std::string_view>(packet.param3);
-
+static _rpcRet _rpc_Player_doNotify(int connId, std::string_view command, std::string_view jsonData) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -149,14 +126,7 @@ static _rpcRet _rpc_Player_doNotify(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_thinking(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Player_thinking(int connId) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -166,17 +136,7 @@ static _rpcRet _rpc_Player_thinking(const JsonRpcPacket &packet) {
   return { true, isThinking };
 }
 
-static _rpcRet _rpc_Player_setThinking(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<bool>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  bool thinking = std::get<bool>(packet.param2);
-
+static _rpcRet _rpc_Player_setThinking(int connId, bool thinking) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -186,17 +146,7 @@ static _rpcRet _rpc_Player_setThinking(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_setDied(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<bool>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  bool died = std::get<bool>(packet.param2);
-
+static _rpcRet _rpc_Player_setDied(int connId, bool died) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -206,14 +156,7 @@ static _rpcRet _rpc_Player_setDied(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_emitKick(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Player_emitKick(int connId) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, "Player not found"sv };
@@ -225,15 +168,7 @@ static _rpcRet _rpc_Player_emitKick(const JsonRpcPacket &packet) {
 
 // part3: Room相关
 
-static _rpcRet _rpc_Room_delay(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<int>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-  int id = std::get<int>(packet.param1);
-  int ms = std::get<int>(packet.param2);
+static _rpcRet _rpc_Room_delay(int id, int ms) {
   if (ms <= 0) {
     return { false, nullVal };
   }
@@ -247,23 +182,8 @@ static _rpcRet _rpc_Room_delay(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_updatePlayerWinRate(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 5 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<int>(packet.param2) &&
-    std::holds_alternative<std::string_view>(packet.param3) &&
-    std::holds_alternative<std::string_view>(packet.param4) &&
-    std::holds_alternative<int>(packet.param5)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
-  int playerId = std::get<int>(packet.param2);
-  auto mode = std::get<std::string_view>(packet.param3);
-  auto role = std::get<std::string_view>(packet.param4);
-  int result = std::get<int>(packet.param5);
-
+static _rpcRet _rpc_Room_updatePlayerWinRate(int roomId, int playerId, std::string_view mode,
+                                             std::string_view role, int result) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -274,23 +194,8 @@ static _rpcRet _rpc_Room_updatePlayerWinRate(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_updateGeneralWinRate(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 5 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2) &&
-    std::holds_alternative<std::string_view>(packet.param3) &&
-    std::holds_alternative<std::string_view>(packet.param4) &&
-    std::holds_alternative<int>(packet.param5)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
-  auto general = std::get<std::string_view>(packet.param2);
-  auto mode = std::get<std::string_view>(packet.param3);
-  auto role = std::get<std::string_view>(packet.param4);
-  int result = std::get<int>(packet.param5);
-
+static _rpcRet _rpc_Room_updateGeneralWinRate(int roomId, std::string_view general, std::string_view mode,
+                                              std::string_view role, int result) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -301,14 +206,7 @@ static _rpcRet _rpc_Room_updateGeneralWinRate(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_gameOver(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Room_gameOver(int roomId) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -319,16 +217,7 @@ static _rpcRet _rpc_Room_gameOver(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_setRequestTimer(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<int>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  int id = std::get<int>(packet.param1);
-  int ms = std::get<int>(packet.param2);
+static _rpcRet _rpc_Room_setRequestTimer(int id, int ms) {
   if (ms <= 0) {
     return { false, nullVal };
   }
@@ -343,14 +232,7 @@ static _rpcRet _rpc_Room_setRequestTimer(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_destroyRequestTimer(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Room_destroyRequestTimer(int roomId) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -361,14 +243,7 @@ static _rpcRet _rpc_Room_destroyRequestTimer(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_decreaseRefCount(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Room_decreaseRefCount(int roomId) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -379,14 +254,7 @@ static _rpcRet _rpc_Room_decreaseRefCount(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Room_getSessionId(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Room_getSessionId(int roomId) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -397,14 +265,7 @@ static _rpcRet _rpc_Room_getSessionId(const JsonRpcPacket &packet) {
   return { true, id };
 }
 
-static _rpcRet _rpc_Room_getSessionData(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
+static _rpcRet _rpc_Room_getSessionData(int roomId) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -415,16 +276,7 @@ static _rpcRet _rpc_Room_getSessionData(const JsonRpcPacket &packet) {
   return { true, s };
 }
 
-static _rpcRet _rpc_Room_setSessionData(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  int roomId = std::get<int>(packet.param1);
-  auto jsonData = std::get<std::string_view>(packet.param2);
+static _rpcRet _rpc_Room_setSessionData(int roomId, std::string_view jsonData) {
   auto room = Server::instance().room_manager().findRoom(roomId).lock();
   if (!room) {
     return { false, "Room not found"sv };
@@ -435,17 +287,7 @@ static _rpcRet _rpc_Room_setSessionData(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_saveState(const JsonRpcPacket &packet) {
-  if (!(packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto jsonData = std::get<std::string_view>(packet.param2);
-
+static _rpcRet _rpc_Player_saveState(int connId, std::string_view jsonData) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, nullVal };
@@ -455,37 +297,18 @@ static _rpcRet _rpc_Player_saveState(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_getSaveState(const JsonRpcPacket &packet) {
-  if (!(packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-
+static _rpcRet _rpc_Player_getSaveState(int connId) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, nullVal };
   }
 
-  std::string result = player->getSaveState();
-  return { true, result };
+  auto &result = resultBuffer();
+  result = player->getSaveState();
+  return { true, std::string_view { result } };
 }
 
-static _rpcRet _rpc_Player_saveGlobalState(const JsonRpcPacket &packet) {
-  if (!(packet.param_count == 3 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2) &&
-    std::holds_alternative<std::string_view>(packet.param3)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto key = std::get<std::string_view>(packet.param2);
-  auto jsonData = std::get<std::string_view>(packet.param3);
-
+static _rpcRet _rpc_Player_saveGlobalState(int connId, std::string_view key, std::string_view jsonData) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, nullVal };
@@ -495,24 +318,15 @@ static _rpcRet _rpc_Player_saveGlobalState(const JsonRpcPacket &packet) {
   return { true, nullVal };
 }
 
-static _rpcRet _rpc_Player_getGlobalSaveState(const JsonRpcPacket &packet) {
-  if (!(packet.param_count == 2 &&
-    std::holds_alternative<int>(packet.param1) &&
-    std::holds_alternative<std::string_view>(packet.param2)
-  )) {
-    return { false, nullVal };
-  }
-
-  auto connId = std::get<int>(packet.param1);
-  auto key = std::get<std::string_view>(packet.param2);
-
+static _rpcRet _rpc_Player_getGlobalSaveState(int connId, std::string_view key) {
   auto player = Server::instance().user_manager().findPlayerByConnId(connId).lock();
   if (!player) {
     return { false, nullVal };
   }
 
-  std::string result = player->getGlobalSaveState(key);
-  return { true, result };
+  auto &result = resultBuffer();
+  result = player->getGlobalSaveState(key);
+  return { true, std::string_view { result } };
 }
 
 
@@ -521,7 +335,11 @@ static _rpcRet _rpc_Player_getGlobalSaveState(const JsonRpcPacket &packet) {
 std::string RpcDispatchers::getPlayerObject(Player &p) {
   std::string ret;
   ret.reserve(256);
+  appendPlayerObject(ret, p);
+  return ret;
+}
 
+void RpcDispatchers::appendPlayerObject(std::string &ret, Player &p) {
   u_char buf[10]; size_t buflen;
 
   ret.push_back('\xA7');
@@ -564,16 +382,9 @@ std::string RpcDispatchers::getPlayerObject(Player &p) {
   buflen = cbor_encode_uint(p.getGameData()[2], buf, 10);
   ret += std::string_view { (char *)buf, buflen };
 
-  return ret;
 }
 
-static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
-  if (!( packet.param_count == 1 &&
-    std::holds_alternative<int>(packet.param1)
-  )) {
-    return { false, nullVal };
-  }
-  int id = std::get<int>(packet.param1);
+static _rpcRet _rpc_RoomThread_getRoom(int id) {
   if (id <= 0) {
     return { false, nullVal };
   }
@@ -586,7 +397,9 @@ static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
   const auto &pids = room->getPlayers();
   auto settings = room->getSettings();
   u_char buf[10]; size_t buflen;
-  std::string ret;
+  // 直接写进结果缓冲区，房间对象再大也不用每次重新分配
+  auto &ret = resultBuffer();
+  ret.clear();
   ret.reserve(256 * pids.size() + settings.size() + 64);
 
   ret += "\xA5";
@@ -601,7 +414,7 @@ static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
   auto &um = Server::instance().user_manager();
   for (auto pid : pids) {
     auto p = um.findPlayerByConnId(pid).lock();
-    if (p) ret += RpcDispatchers::getPlayerObject(*p);
+    if (p) RpcDispatchers::appendPlayerObject(ret, *p);
   }
 
   ret += "\x47ownerId";
@@ -619,38 +432,40 @@ static _rpcRet _rpc_RoomThread_getRoom(const JsonRpcPacket &packet) {
   ret += std::string_view { (char *)buf, buflen };
   ret += settings;
 
-  return { true, ret };
+  return { true, std::string_view { ret } };
 }
 
-const JsonRpc::RpcMethodMap RpcDispatchers::ServerRpcMethods {
-  { "qDebug", _rpc_qDebug },
-  { "qInfo", _rpc_qInfo },
-  { "qWarning", _rpc_qWarning },
-  { "qCritical", _rpc_qCritical },
+static constexpr auto rpcMethods = JsonRpc::makeRpcMethods({
+  { "qDebug", typed<_rpc_qDebug> },
+  { "qInfo", typed<_rpc_qInfo> },
+  { "qWarning", typed<_rpc_qWarning> },
+  { "qCritical", typed<_rpc_qCritical> },
   { "print", _rpc_print },
 
-  { "ServerPlayer_doRequest", _rpc_Player_doRequest },
-  { "ServerPlayer_waitForReply", _rpc_Player_waitForReply },
-  { "ServerPlayer_doNotify", _rpc_Player_doNotify },
-  { "ServerPlayer_thinking", _rpc_Player_thinking },
-  { "ServerPlayer_setThinking", _rpc_Player_setThinking },
-  { "ServerPlayer_setDied", _rpc_Player_setDied },
-  { "ServerPlayer_emitKick", _rpc_Player_emitKick },
-  { "ServerPlayer_saveState", _rpc_Player_saveState },
-  { "ServerPlayer_getSaveState", _rpc_Player_getSaveState },
-  { "ServerPlayer_saveGlobalState", _rpc_Player_saveGlobalState },
-  { "ServerPlayer_getGlobalSaveState", _rpc_Player_getGlobalSaveState },
-
-  { "Room_delay", _rpc_Room_delay },
-  { "Room_updatePlayerWinRate", _rpc_Room_updatePlayerWinRate },
-  { "Room_updateGeneralWinRate", _rpc_Room_updateGeneralWinRate },
-  { "Room_gameOver", _rpc_Room_gameOver },
-  { "Room_setRequestTimer", _rpc_Room_setRequestTimer },
-  { "Room_destroyRequestTimer", _rpc_Room_destroyRequestTimer },
-  { "Room_decreaseRefCount", _rpc_Room_decreaseRefCount },
-  { "Room_getSessionId", _rpc_Room_getSessionId },
-  { "Room_getSessionData", _rpc_Room_getSessionData },
-  { "Room_setSessionData", _rpc_Room_setSessionData },
-
-  { "RoomThread_getRoom", _rpc_RoomThread_getRoom },
-};
+  { "ServerPlayer_doRequest", typed<_rpc_Player_doRequest> },
+  { "ServerPlayer_waitForReply", typed<_rpc_Player_waitForReply> },
+  { "ServerPlayer_doNotify", typed<_rpc_Player_doNotify> },
+  { "ServerPlayer_thinking", typed<_rpc_Player_thinking> },
+  { "ServerPlayer_setThinking", typed<_rpc_Player_setThinking> },
+  { "ServerPlayer_setDied", typed<_rpc_Player_setDied> },
+  { "ServerPlayer_emitKick", typed<_rpc_Player_emitKick> },
+  { "ServerPlayer_saveState", typed<_rpc_Player_saveState> },
+  { "ServerPlayer_getSaveState", typed<_rpc_Player_getSaveState> },
+  { "ServerPlayer_saveGlobalState", typed<_rpc_Player_saveGlobalState> },
+  { "ServerPlayer_getGlobalSaveState", typed<_rpc_Player_getGlobalSaveState> },
+
+  { "Room_delay", typed<_rpc_Room_delay> },
+  { "Room_updatePlayerWinRate", typed<_rpc_Room_updatePlayerWinRate> },
+  { "Room_updateGeneralWinRate", typed<_rpc_Room_updateGeneralWinRate> },
+  { "Room_gameOver", typed<_rpc_Room_gameOver> },
+  { "Room_setRequestTimer", typed<_rpc_Room_setRequestTimer> },
+  { "Room_destroyRequestTimer", typed<_rpc_Room_destroyRequestTimer> },
+  { "Room_decreaseRefCount", typed<_rpc_Room_decreaseRefCount> },
+  { "Room_getSessionId", typed<_rpc_Room_getSessionId> },
+  { "Room_getSessionData", typed<_rpc_Room_getSessionData> },
+  { "Room_setSessionData", typed<_rpc_Room_setSessionData> },
+
+  { "RoomThread_getRoom", typed<_rpc_RoomThread_getRoom> },
+});
+
+const JsonRpc::RpcMethodTable RpcDispatchers::ServerRpcMethods { rpcMethods };
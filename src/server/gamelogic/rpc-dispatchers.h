@@ -9,7 +9,8 @@ class Player;
 namespace RpcDispatchers {
 
 extern std::string getPlayerObject(Player &p);
+extern void appendPlayerObject(std::string &out, Player &p);
 
-extern const JsonRpc::RpcMethodMap ServerRpcMethods;
+extern const JsonRpc::RpcMethodTable ServerRpcMethods;
 
 }
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/gamelogic/timer-wheel.h"
+
+namespace asio = boost::asio;
+using namespace std::chrono;
+
+TimerWheel::TimerWheel(io_context &ctx, Callback on_expired)
+  : m_timer { ctx }, m_on_expired { std::move(on_expired) }
+{
+  m_slots.fill(-1);
+}
+
+auto TimerWheel::arm(int ms, int roomId, const char *reason) -> Handle {
+  auto now = steady_clock::now();
+  // 空着的轮子里没有东西以m_next_tick为准，直接从现在开始算
+  if (m_count == 0) {
+    m_next_tick = now + milliseconds(tick_ms);
+  }
+
+  // 落在“到期时间不早于now + ms”的第一格，宁可晚一点也不能提前
+  auto target = now + milliseconds(std::max(ms, 0));
+  int64_t ticks = 0;
+  if (target > m_next_tick) {
+    auto late = duration_cast<microseconds>(target - m_next_tick).count();
+    ticks = (late + tick_ms * 1000 - 1) / (tick_ms * 1000);
+  }
+
+  auto idx = allocNode();
+  auto &node = m_nodes[idx];
+  node.roomId = roomId;
+  node.reason = reason;
+  node.rounds = ticks / slot_count;
+  link(idx, (m_cursor + ticks) % slot_count);
+  m_count++;
+
+  if (!m_waiting) schedule();
+  return ((Handle)node.generation << 32) | idx;
+}
+
+void TimerWheel::cancel(Handle h) {
+  auto idx = (uint32_t)h;
+  auto generation = (uint32_t)(h >> 32);
+  if (h == 0 || idx >= m_nodes.size()) return;
+
+  auto &node = m_nodes[idx];
+  if (node.generation != generation || node.slot < 0) return;
+
+  // asio计时器不用管，到时候醒来发现没东西就不再等了
+  unlink(idx);
+  releaseNode(idx);
+  m_count--;
+}
+
+void TimerWheel::clear() {
+  for (auto &head : m_slots) {
+    while (head >= 0) {
+      auto idx = (uint32_t)head;
+      unlink(idx);
+      releaseNode(idx);
+    }
+  }
+  m_count = 0;
+}
+
+size_t TimerWheel::size() const {
+  return m_count;
+}
+
+uint32_t TimerWheel::allocNode() {
+  if (m_free.empty()) {
+    m_nodes.emplace_back();
+    return m_nodes.size() - 1;
+  }
+  auto idx = m_free.back();
+  m_free.pop_back();
+  return idx;
+}
+
+void TimerWheel::releaseNode(uint32_t idx) {
+  auto &node = m_nodes[idx];
+  node.slot = -1;
+  node.reason = nullptr;
+  if (++node.generation == 0) node.generation = 1;
+  m_free.push_back(idx);
+}
+
+void TimerWheel::link(uint32_t idx, size_t slot) {
+  auto &node = m_nodes[idx];
+  node.slot = slot;
+  node.prev = -1;
+  node.next = m_slots[slot];
+  if (node.next >= 0) m_nodes[node.next].prev = idx;
+  m_slots[slot] = idx;
+}
+
+void TimerWheel::unlink(uint32_t idx) {
+  auto &node = m_nodes[idx];
+  if (node.prev >= 0) {
+    m_nodes[node.prev].next = node.next;
+  } else {
+    m_slots[node.slot] = node.next;
+  }
+  if (node.next >= 0) m_nodes[node.next].prev = node.prev;
+  node.prev = node.next = -1;
+}
+
+void TimerWheel::schedule() {
+  m_waiting = true;
+  m_timer.expires_at(m_next_tick);
+  m_timer.async_wait([this](const boost::system::error_code &ec) {
+    m_waiting = false;
+    if (ec) {
+      if (ec != asio::error::operation_aborted) {
+        spdlog::error("error in timer wheel: {}", ec.message());
+      }
+      if (m_count > 0) schedule();
+      return;
+    }
+    advance();
+  });
+}
+
+void TimerWheel::advance() {
+  auto now = steady_clock::now();
+
+  // 线程被卡住的话一次补走好几格，到期的都放进同一批
+  while (m_count > 0 && m_next_tick <= now) {
+    auto idx = m_slots[m_cursor];
+    while (idx >= 0) {
+      auto &node = m_nodes[idx];
+      auto next = node.next;
+      if (node.rounds > 0) {
+        node.rounds--;
+      } else {
+        m_expired.push_back({ node.roomId, node.reason });
+        unlink(idx);
+        releaseNode(idx);
+        m_count--;
+      }
+      idx = next;
+    }
+
+    m_cursor = (m_cursor + 1) % slot_count;
+    m_next_tick += milliseconds(tick_ms);
+  }
+
+  if (!m_expired.empty()) {
+    // 回调里Lua多半会再设计时器，用换出来的这份，再把容量还回去
+    std::vector<Expired> batch;
+    batch.swap(m_expired);
+    m_on_expired(batch);
+    batch.clear();
+    if (m_expired.empty()) m_expired.swap(batch);
+  }
+
+  if (m_count > 0 && !m_waiting) schedule();
+}
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// RoomThread里所有房间的delay和request计时器共用的哈希时间轮
+// tick_ms毫秒一格，slot_count格一圈，更远的记下还要转几圈；整个轮子只挂一个asio计时器，
+// 没有计时器时就不转。节点放在池子里反复用，挂上和取消都是O(1)
+// 同一格（或者线程忙不过来时连续几格）里到期的一次交给回调，方便合成一批ResumeRoom
+#pragma once
+
+class TimerWheel {
+public:
+  using io_context = boost::asio::io_context;
+  // 高32位是代数，低32位是节点下标；节点回收时代数加一，旧句柄自然失效；0表示没有计时器
+  using Handle = uint64_t;
+
+  struct Expired {
+    int roomId;
+    const char *reason;
+  };
+  using Callback = std::function<void(std::span<const Expired>)>;
+
+  enum { tick_ms = 10, slot_count = 512 };
+
+  TimerWheel(io_context &ctx, Callback on_expired);
+  TimerWheel(TimerWheel &) = delete;
+  TimerWheel(TimerWheel &&) = delete;
+
+  // 以下都只能在ctx所在的线程里调用，回调里也可以
+  // reason要一直有效，传字符串字面量就行
+  Handle arm(int ms, int roomId, const char *reason);
+  // 已经到期、取消过或者被clear掉的句柄什么也不做
+  void cancel(Handle h);
+  void clear();
+  size_t size() const;
+
+private:
+  struct Node {
+    int roomId = 0;
+    const char *reason = nullptr;
+    uint32_t rounds = 0;
+    uint32_t generation = 1;
+    int32_t prev = -1;
+    int32_t next = -1;
+    int32_t slot = -1; // -1表示在空闲链表里
+  };
+
+  uint32_t allocNode();
+  void releaseNode(uint32_t idx);
+  void link(uint32_t idx, size_t slot);
+  void unlink(uint32_t idx);
+
+  void schedule();
+  void advance();
+
+  boost::asio::steady_timer m_timer;
+  bool m_waiting = false;
+  Callback m_on_expired;
+
+  std::vector<Node> m_nodes;
+  std::vector<uint32_t> m_free;
+  std::array<int32_t, slot_count> m_slots; // 每格一条双向链表的表头
+  size_t m_count = 0;
+
+  size_t m_cursor = 0; // 下一个要处理的格子
+  std::chrono::steady_clock::time_point m_next_tick; // m_cursor这一格的到期时间
+
+  std::vector<Expired> m_expired;
+};
@@ -7,6 +7,7 @@
 #include "server/room/room_manager.h"
 #include "server/room/room.h"
 #include "network/client_socket.h"
+#include "network/router.h"
 
 #include "core/c-wrapper.h"
 #include "core/util.h"
@@ -44,13 +45,13 @@ void Lobby::removePlayer(Player &player) {
 
 void Lobby::updateOnlineInfo() {
   auto &um = Server::instance().user_manager();
-  auto arr = Cbor::encodeArray({
+  auto frame = Router::encodeNotification("UpdatePlayerNum", Cbor::encodeArray({
     players.size(),
     um.getPlayers().size(),
-  });
+  }));
   for (auto &[pid, _] : players) {
     auto p = um.findPlayerByConnId(pid).lock();
-    if (p) p->doNotify("UpdatePlayerNum", arr);
+    if (p) p->doNotify(frame, ClientSocket::MergeOnlineCount);
   }
 }
 
@@ -57,6 +57,7 @@ Room::~Room() {
 
   auto thr = Server::instance().getThread(m_thread_id).lock();
   if (thr) {
+    thr->cancelTimer(request_timer);
     thr->removeRoom(id);
     thr->decreaseRefCount();
   }
@@ -302,8 +303,7 @@ void Room::removePlayer(Player &player) {
 
     // 设完state后把房间叫起来
     if (player.thinking()) {
-      auto thread = this->thread().lock();
-      if (thread) thread->wakeUp(id, "player_disconnect");
+      withThread([id = id](RoomThread &t) { t.wakeUp(id, "player_disconnect"); });
     }
 
     // 然后基于跑路玩家的socket，创建一个新Player对象用来通信
@@ -340,8 +340,7 @@ void Room::addObserver(Player &player) {
   observers.push_back(player.getConnId());
   player.setRoom(*this);
 
-  auto thread = this->thread().lock();
-  thread->addObserver(player.getConnId(), id);
+  withThread([id = id, connId = player.getConnId()](RoomThread &t) { t.addObserver(connId, id); });
   pushRequest(fmt::format("{},observe", player.getId()));
 }
 
@@ -360,8 +359,7 @@ void Room::removeObserver(Player &player) {
 
   pushRequest(fmt::format("{},leave", player.getId()));
 
-  auto thread = this->thread().lock();
-  if (thread) thread->removeObserver(player.getId(), id);
+  withThread([id = id, pid = player.getId()](RoomThread &t) { t.removeObserver(pid, id); });
 }
 
 bool Room::hasObserver(Player &player) const {
@@ -400,6 +398,125 @@ void Room::setThread(RoomThread &t) {
   t.increaseRefCount();
 }
 
+void Room::withThread(std::function<void(RoomThread &)> f) {
+  if (m_migrating) {
+    m_migration_queue.push_back(std::move(f));
+    return;
+  }
+  auto thr = thread().lock();
+  if (thr) f(*thr);
+}
+
+bool Room::isMigrating() const {
+  return m_migrating;
+}
+
+bool Room::migrateTo(RoomThread &target) {
+  if (m_migrating || target.id() == m_thread_id) return false;
+  if (target.isOutdated() || target.isFull()) return false;
+  auto old = thread().lock();
+
+  if (!isStarted()) {
+    if (old) old->removeRoom(id);
+    setThread(target);
+    if (old) old->decreaseRefCount();
+    spdlog::info("Room {} moved to thread {}", id, target.id());
+    return true;
+  }
+
+  if (!old || !old->isReady() || !old->supportsMigration()) return false;
+  // 开打的房间里玩家和存档用的都是原来的包，只能搬到包一样的线程里，不然和客户端对不上
+  if (target.getMd5() != md5) return false;
+
+  m_migrating = true;
+  spdlog::info("Migrating room {} from thread {} to {}", id, old->id(), target.id());
+  old->exportRoom(id, [weak = weak_from_this(), from = old->id(), to = target.id()]
+                  (bool ok, std::string state) {
+    auto room = weak.lock();
+    if (room) room->onRoomExported(from, to, ok, std::move(state));
+  });
+  return true;
+}
+
+void Room::onRoomExported(int from, int to, bool ok, std::string state) {
+  auto &server = Server::instance();
+  auto old = server.getThread(from).lock();
+  if (!ok) {
+    spdlog::warn("Room {} cannot be exported from thread {}, staying there", id, from);
+    m_migrating = false;
+    auto queue = std::move(m_migration_queue);
+    for (auto &f : queue) withThread(std::move(f));
+    return;
+  }
+
+  // 导出成功后旧Lua已经不管这个房间了；目标线程这期间没了或者换了包的话就导回原来的线程
+  auto target = server.getThread(to).lock();
+  if (!target || target->isOutdated()) target = old;
+  if (!target) {
+    m_migrating = false;
+    m_migration_queue.clear();
+    onImportFailed(to);
+    return;
+  }
+
+  if (target != old) {
+    // migrateTo保证了目标线程和房间用的是同一套包，md5不会变
+    if (old) old->removeRoom(id);
+    setThread(*target);
+    if (old) old->decreaseRefCount();
+
+    // 计时器挂在旧线程的时间轮上，在那边取消；新Lua导入时自己重新设
+    if (old) old->cancelTimer(request_timer);
+    request_timer = 0;
+  }
+
+  // 导入完成之前请求继续攒着，不然新Lua可能先收到一个它还没有的房间的请求
+  target->importRoom(id, std::move(state), [weak = weak_from_this(), to = target->id()](bool ok) {
+    auto room = weak.lock();
+    if (room) room->onRoomImported(to, ok);
+  });
+}
+
+void Room::onRoomImported(int to, bool ok) {
+  m_migrating = false;
+  if (!ok) {
+    m_migration_queue.clear();
+    onImportFailed(to);
+    return;
+  }
+
+  // 让Lua看看导入后的房间接下来该干嘛，然后才是迁移期间攒下的请求
+  auto thr = thread().lock();
+  if (thr) thr->wakeUp(id, "migrated");
+  auto queue = std::move(m_migration_queue);
+  for (auto &f : queue) withThread(std::move(f));
+  spdlog::info("Room {} migrated to thread {}", id, to);
+}
+
+void Room::onImportFailed(int to) {
+  spdlog::error("Room {} cannot be restored in thread {}, closing it", id, to);
+  abortByLuaError();
+}
+
+void Room::abortByLuaError() {
+  // 无论如何都减一下 因为Lua肯定不存在了
+  decreaseRefCount();
+
+  setOutdated();
+  doBroadcastNotify(getPlayers(), "ErrorDlg", "Server Internal Error");
+  Server::instance().room_manager().removeRoom(id);
+}
+
+void Room::setCheckpoint(int session, std::string state) {
+  m_checkpoint_session = session;
+  m_checkpoint = std::move(state);
+}
+
+std::string_view Room::getCheckpoint() const {
+  if (m_checkpoint_session != session_id) return {};
+  return m_checkpoint;
+}
+
 void Room::checkAbandoned(CheckAbandonReason reason) {
   asio::post(Server::instance().context(), [reason, weak = weak_from_this()] {
     auto ptr = weak.lock();
@@ -431,8 +548,7 @@ void Room::_checkAbandoned(CheckAbandonReason reason) {
 
   if (!isAbandoned()) return;
   if (getRefCount() > 0) {
-    auto thr = thread().lock();
-    if (thr) thr->wakeUp(id, "abandon");
+    withThread([id = id](RoomThread &t) { t.wakeUp(id, "abandon"); });
     return;
   }
 
@@ -624,18 +740,18 @@ void Room::updatePlayerGameTime() {
     server.database().exec(info_update);
 
     // 然后时间得告诉别人
-    auto bytes = Cbor::encodeArray( { pid, time } );
+    auto frame = Router::encodeNotification("AddTotalGameTime", Cbor::encodeArray( { pid, time } ));
     for (auto connId : players) {
       if (connId == pConnId) continue;
       auto p2 = um.findPlayerByConnId(connId).lock();
-      if (p2) p2->doNotify("AddTotalGameTime", bytes);
+      if (p2) p2->doNotify(frame);
     }
 
     // 考虑到阵亡已离开啥的，时间得给真实玩家增加
     auto realPlayer = um.findPlayer(pid).lock();
     if (realPlayer) {
       realPlayer->addTotalGameTime(time);
-      realPlayer->doNotify("AddTotalGameTime", bytes);
+      realPlayer->doNotify(frame);
     }
   }
   server.endTransaction();
@@ -751,8 +867,7 @@ void Room::manuallyStart() {
 }
 
 void Room::pushRequest(const std::string &req) {
-  auto thread = this->thread().lock();
-  if (thread) thread->pushRequest(fmt::format("{},{}", id, req));
+  withThread([msg = fmt::format("{},{}", id, req)](RoomThread &t) { t.pushRequest(msg); });
 }
 
 void Room::addRejectId(int id) {
@@ -833,8 +948,7 @@ void Room::trust(Player &player, const Packet &pkt) {
   if (player.getState() != Player::Trust) {
     player.setState(Player::Trust);
     if (player.thinking()) {
-      auto thread = this->thread().lock();
-      if (thread) thread->wakeUp(id, "player_trust");
+      withThread([id = id](RoomThread &t) { t.wakeUp(id, "player_trust"); });
     }
   } else {
     player.setState(Player::Online);
@@ -962,31 +1076,18 @@ void Room::handlePacket(Player &sender, const Packet &packet) {
 void Room::setRequestTimer(int ms) {
   auto thread = this->thread().lock();
   if (!thread) return;
-  auto &ctx = thread->context();
-
-  request_timer = std::make_unique<asio::steady_timer>(
-    ctx, std::chrono::milliseconds(ms));
 
-  // 不能让即将运行在thread中的lambda捕获到shared_ptr，否则可能会线程内析构自身导致死锁
-  auto weak_thr = std::weak_ptr(thread);
-  request_timer->async_wait([this, weak_thr](const std::error_code& ec){
-    if (!ec) {
-      auto thread = weak_thr.lock();
-      if (thread) thread->wakeUp(id, "request_timer");
-    } else {
-      // 我们本来就会调cancel()并销毁requestTimer，所以aborted的情况很多很多
-      if (ec.value() != asio::error::operation_aborted) {
-        spdlog::error("error in request timer of room {}: {}", id, ec.message());
-      }
-    }
-  });
+  // 上一个没销毁的话顶掉
+  thread->cancelTimer(request_timer);
+  request_timer = thread->addTimer(id, ms, "request_timer");
 }
 
 // Lua用：当request完成后手动销毁计时器。
 void Room::destroyRequestTimer() {
   if (!request_timer) return;
-  request_timer->cancel();
-  request_timer = nullptr;
+  auto thread = this->thread().lock();
+  if (thread) thread->cancelTimer(request_timer);
+  request_timer = 0;
 }
 
 int Room::getRefCount() {
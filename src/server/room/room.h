@@ -60,6 +60,20 @@ public:
 
   std::weak_ptr<RoomThread> thread() const;
   void setThread(RoomThread &);
+  // 主线程里要交给房间所在RoomThread的事情都走这里；迁移途中先攒着，迁完了按顺序交给新线程
+  void withThread(std::function<void(RoomThread &)> f);
+
+  // 把房间搬到另一个RoomThread，返回false表示没法开始迁移
+  // 没开打的房间Lua还不知道，直接换线程；开打了的要旧Lua导出、新Lua导入，期间请求先攒着
+  bool migrateTo(RoomThread &target);
+  bool isMigrating() const;
+
+  // Lua那边已经没有这个房间了：提示出错并删除房间
+  void abortByLuaError();
+
+  // Lua定期存的档，只对存档时的那一局有效；Lua崩溃重启后用它恢复
+  void setCheckpoint(int session, std::string state);
+  std::string_view getCheckpoint() const;
 
   enum CheckAbandonReason {
     NoRefCount,
@@ -125,7 +139,17 @@ private:
   // 以及某个供Lua往里面放点数据的东西
   std::string session_data = "{}";
 
-  std::unique_ptr<boost::asio::steady_timer> request_timer = nullptr;
+  // 所在RoomThread时间轮里的句柄，0表示没有
+  uint64_t request_timer = 0;
+
+  std::string m_checkpoint;
+  int m_checkpoint_session = -1;
+
+  bool m_migrating = false;
+  std::vector<std::function<void(RoomThread &)>> m_migration_queue;
+  void onRoomExported(int from, int to, bool ok, std::string state);
+  void onRoomImported(int to, bool ok);
+  void onImportFailed(int to);
 
   void createRunnedPlayer(Player &player, std::shared_ptr<ClientSocket> socket);
   void detectSameIpAndDevice();
@@ -8,6 +8,7 @@
 #include "server/user/user_manager.h"
 #include "server/user/player.h"
 #include "network/client_socket.h"
+#include "network/router.h"
 
 bool RoomBase::isLobby() const {
   return dynamic_cast<const Lobby *>(this) != nullptr;
@@ -15,12 +16,18 @@ bool RoomBase::isLobby() const {
 
 int RoomBase::getId() const { return id; }
 
-void RoomBase::doBroadcastNotify(const std::vector<int> targets,
+void RoomBase::doBroadcastNotify(const std::vector<int> &targets,
                                  const std::string_view &command, const std::string_view &cborData) {
+  if (targets.empty()) return;
+  doBroadcastNotify(targets, Router::encodeNotification(command, cborData));
+}
+
+void RoomBase::doBroadcastNotify(const std::vector<int> &targets,
+                                 const std::shared_ptr<const std::string> &frame) {
   auto &um = Server::instance().user_manager();
   for (auto connId : targets) {
     auto p = um.findPlayerByConnId(connId).lock();
-    if (p) p->doNotify(command, cborData);
+    if (p) p->doNotify(frame);
   }
 }
 
@@ -99,9 +106,10 @@ void RoomBase::chat(Player &sender, const Packet &packet) {
     uint_buf[0] += 0x60; // uint(n) -> str(#)
     oss << std::string_view { uint_buf, uint_len } << msg;
 
+    auto frame = Router::encodeNotification("Chat", oss.str());
     for (auto &[pid, _] : lobby->getPlayers()) {
       auto p = um.findPlayerByConnId(pid).lock();
-      if (p) p->doNotify("Chat", oss.str());
+      if (p) p->doNotify(frame);
     }
   } else {
     auto room = dynamic_cast<Room *>(this);
@@ -114,8 +122,9 @@ void RoomBase::chat(Player &sender, const Packet &packet) {
     uint_buf[0] += 0x60; // uint(n) -> str(#)
     oss << std::string_view { uint_buf, uint_len } << msg;
 
-    room->doBroadcastNotify(room->getPlayers(), "Chat", oss.str());
-    room->doBroadcastNotify(room->getObservers(), "Chat", oss.str());
+    auto frame = Router::encodeNotification("Chat", oss.str());
+    room->doBroadcastNotify(room->getPlayers(), frame);
+    room->doBroadcastNotify(room->getObservers(), frame);
   }
 
   spdlog::info("[Chat/{}] {}: {}",
@@ -18,8 +18,10 @@ public:
 
   int getId() const;
 
-  void doBroadcastNotify(const std::vector<int> targets,
+  void doBroadcastNotify(const std::vector<int> &targets,
                          const std::string_view &command, const std::string_view &cborData);
+  void doBroadcastNotify(const std::vector<int> &targets,
+                         const std::shared_ptr<const std::string> &frame);
 
   void chat(Player &sender, const Packet &);
 
@@ -30,7 +30,7 @@ void JsonRpcPacket::reset() {
   method = "";
 }
 
-std::optional<JsonRpcError> getErrorObject(const std::string &errorName) {
+std::optional<JsonRpcError> getErrorObject(std::string_view errorName) {
   auto it = errorObjects.find(errorName);
   if (it != errorObjects.end()) {
     return it->second;
@@ -92,7 +92,7 @@ JsonRpcPacket response(const JsonRpcPacket &req, const JsonRpcParam &result) {
   return res;
 }
 
-JsonRpcPacket responseError(const JsonRpcPacket &req, const std::string &errorName,
+JsonRpcPacket responseError(const JsonRpcPacket &req, std::string_view errorName,
                           const JsonRpcParam &data) {
   auto errorOpt = getErrorObject(errorName);
   if (!errorOpt) {
@@ -120,18 +120,18 @@ JsonRpcPacket responseError(const JsonRpcPacket &req, const std::string &errorNa
 }
 
 std::optional<JsonRpcPacket>
-handleRequest(const RpcMethodMap &methods, const JsonRpcPacket &req) {
+handleRequest(const RpcMethodTable &methods, const JsonRpcPacket &req) {
   if (req.method == "") {
     return responseError(req, "invalid_request");
   }
 
-  auto it = methods.find(req.method);
-  if (it == methods.end()) {
+  auto entry = methods.find(req.method);
+  if (!entry) {
     return responseError(req, "method_not_found");
   }
 
   try {
-    auto [success, result] = it->second(req);
+    auto [success, result] = entry->method(req);
     if (!success) {
       // Assume error info is in result
       return responseError(req, "invalid_params", result);
@@ -141,10 +141,18 @@ handleRequest(const RpcMethodMap &methods, const JsonRpcPacket &req) {
     }
     return response(req, result);
   } catch (const std::exception &e) {
-    return responseError(req, "internal_error", std::string_view { e.what() });
+    // e出了catch就没了，错误信息得先放到不会消失的地方
+    auto &buf = resultBuffer();
+    buf = e.what();
+    return responseError(req, "internal_error", std::string_view { buf });
   }
 }
 
+std::string &resultBuffer() {
+  thread_local std::string buf;
+  return buf;
+}
+
 int getNextFreeId() { return _reqId; }
 
 } // namespace JsonRpc
@@ -22,14 +22,22 @@ enum JsonKeys {
   ErrorData,
 };
 
-typedef std::variant<int, int64_t, std::string, std::string_view, bool, std::nullptr_t> JsonRpcParam;
+// 参数里只放string_view，不持有内存：收到的包指向读缓冲区，发出的包指向调用者的数据，
+// 返回值指向resultBuffer()；一次RPC从解码到编码都不需要分配内存
+// span<string_view>只用于C++往Lua批量发字符串（HandleRequests），Lua发来的包里不会出现
+typedef std::variant<int, int64_t, std::string_view, bool, std::nullptr_t,
+                     std::span<const std::string_view>> JsonRpcParam;
 
 struct JsonRpcError {
   int code = 0;
-  std::string message = "";
+  std::string_view message = "";
   JsonRpcParam data = nullptr;
 };
 
+// 当前线程上RPC方法返回字符串时用的缓冲区，内容在下一次RPC调用之前有效
+// 每次用之前clear()，容量一直留着
+std::string &resultBuffer();
+
 struct JsonRpcPacket {
   // const char *jsonrpc; // 必定是2.0 不加
   int id = -1; // 负数表示没有id 是notification
@@ -52,9 +60,74 @@ struct JsonRpcPacket {
   JsonRpcPacket(JsonRpcPacket &&) = default;
 };
 
-using RpcMethod =
-    std::function<std::pair<bool, JsonRpcParam>(const JsonRpcPacket &)>;
-using RpcMethodMap = std::map<std::string_view, RpcMethod>;
+using RpcMethod = std::pair<bool, JsonRpcParam> (*)(const JsonRpcPacket &);
+
+struct RpcMethodEntry {
+  std::string_view name;
+  RpcMethod method;
+};
+
+// FNV-1a，种子混进初始值
+constexpr uint32_t rpcMethodHash(std::string_view name, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  for (auto c : name) {
+    h ^= (uint8_t)c;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// 编译期算好的完美哈希：挑一个种子让所有方法名落在不同的槽里，
+// 查找时只需算一次哈希、比一次字符串
+template <size_t N>
+struct RpcMethodStorage {
+  static constexpr size_t SlotCount = std::bit_ceil(N * 4);
+
+  std::array<RpcMethodEntry, N> entries {};
+  std::array<int16_t, SlotCount> slots {};
+  uint32_t seed = 0;
+
+  constexpr bool tryBuild() {
+    slots.fill(-1);
+    for (size_t i = 0; i < N; i++) {
+      auto slot = rpcMethodHash(entries[i].name, seed) & (SlotCount - 1);
+      if (slots[slot] != -1) return false;
+      slots[slot] = i;
+    }
+    return true;
+  }
+};
+
+template <size_t N>
+constexpr RpcMethodStorage<N> makeRpcMethods(const RpcMethodEntry (&methods)[N]) {
+  RpcMethodStorage<N> ret;
+  for (size_t i = 0; i < N; i++) ret.entries[i] = methods[i];
+  while (!ret.tryBuild()) ret.seed++;
+  return ret;
+}
+
+// RpcMethodStorage的只读视图，这样外面不用知道方法个数
+class RpcMethodTable {
+public:
+  template <size_t N>
+  constexpr RpcMethodTable(const RpcMethodStorage<N> &storage)
+    : entries { storage.entries }, slots { storage.slots }, seed { storage.seed } {}
+
+  constexpr const RpcMethodEntry *find(std::string_view name) const {
+    auto idx = slots[rpcMethodHash(name, seed) & (slots.size() - 1)];
+    if (idx < 0 || entries[idx].name != name) return nullptr;
+    return &entries[idx];
+  }
+
+  constexpr auto begin() const { return entries.begin(); }
+  constexpr auto end() const { return entries.end(); }
+  constexpr size_t size() const { return entries.size(); }
+
+private:
+  std::span<const RpcMethodEntry> entries;
+  std::span<const int16_t> slots;
+  uint32_t seed;
+};
 
 extern std::map<std::string_view, JsonRpcError> errorObjects;
 
@@ -62,7 +135,7 @@ extern std::map<std::string_view, JsonRpcError> errorObjects;
 bool isStdError(const std::string_view &errorName);
 
 // 获取错误对象
-std::optional<JsonRpcError> getErrorObject(const std::string &errorName);
+std::optional<JsonRpcError> getErrorObject(std::string_view errorName);
 
 JsonRpcPacket notification(const std::string_view &method,
                            const JsonRpcParam &param1 = nullptr,
@@ -74,11 +147,11 @@ JsonRpcPacket request(const std::string_view &method,
                       const JsonRpcParam &param3 = nullptr,
                       int id = -1);
 JsonRpcPacket response(const JsonRpcPacket &req, const JsonRpcParam &result);
-JsonRpcPacket responseError(const JsonRpcPacket &req, const std::string &errorName,
+JsonRpcPacket responseError(const JsonRpcPacket &req, std::string_view errorName,
                           const JsonRpcParam &data = nullptr);
 
 std::optional<JsonRpcPacket>
-handleRequest(const RpcMethodMap &methods, const JsonRpcPacket &req);
+handleRequest(const RpcMethodTable &methods, const JsonRpcPacket &req);
 
 // 获取下一个可用的请求ID
 int getNextFreeId();
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// RoomThread眼中的Lua：可以是fork出来走RPC的lua5.4进程（RpcLua），
+// 也可以是编进服务器里的lua_State（NativeLua，需要FK_EMBED_LUA）
+#pragma once
+
+#include "server/rpc-lua/jsonrpc.h"
+#include "server/rpc-lua/rpc-stats.h"
+
+class LuaInterface {
+public:
+  using Callback = std::function<void(const JsonRpc::JsonRpcPacket &)>;
+
+  explicit LuaInterface(RpcStats &stats) : m_rpc_stats { stats } {}
+  virtual ~LuaInterface() = default;
+
+  virtual void call(const char *func_name, JsonRpc::JsonRpcParam param1 = nullptr,
+    JsonRpc::JsonRpcParam param2 = nullptr,
+    JsonRpc::JsonRpcParam param3 = nullptr) = 0;
+
+  // 不关心什么时候执行完的调用；on_done可以为空
+  // 出错时on_done也会被调用，这时返回包的error.code不为0；
+  // Lua已经挂了或者等不到返回值时（-32000）也一样，保证每个on_done都会被调用一次
+  virtual void callAsync(const char *func_name, Callback on_done,
+    JsonRpc::JsonRpcParam param1 = nullptr,
+    JsonRpc::JsonRpcParam param2 = nullptr,
+    JsonRpc::JsonRpcParam param3 = nullptr) = 0;
+
+  virtual size_t pendingCount() const = 0;
+  // 上一次call的JSON-RPC错误码，0表示成功；-32601表示Lua没有这个方法
+  virtual int lastError() const = 0;
+
+  virtual std::string getConnectionInfo() const = 0;
+  // Lua在别的进程里消耗的CPU时间（微秒）；跑在RoomThread线程里的算在线程头上，返回0
+  virtual uint64_t cpuTimeUs() const = 0;
+
+  virtual bool alive() const = 0;
+
+  // Lua不能再用时在io_ctx中调用一次
+  virtual void setDiedCallback(std::function<void()> f) = 0;
+
+  // 换掉这个Lua之前在io_ctx中调用：结束所有异步调用，不再等任何事件；
+  // 已经挂在io_ctx上的回调可能还会跑，所以之后要放到下一轮再析构
+  virtual void detach() {}
+
+protected:
+  // 调用统计记在RoomThread上，Lua重启之后接着累计
+  RpcStats &m_rpc_stats;
+};
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/rpc-lua/native-lua.h"
+#include "server/gamelogic/rpc-dispatchers.h"
+#include "core/packman.h"
+
+#include <lua.hpp>
+#include <cjson/cJSON.h>
+
+using namespace JsonRpc;
+namespace asio = boost::asio;
+
+// Lua侧的约定（和子进程模式对应）：
+// - os.getenv("FK_RPC_MODE") == "native"，别的环境变量照旧
+// - 全局表fk_native里是ServerRpcMethods的同名C函数，参数和返回值跟CBOR RPC一样
+// - entry.lua在native模式下不进读stdin的循环，把处理请求的方法表放进全局fk_rpc_methods
+static constexpr const char *CoreRoot = "packages/freekill-core/";
+
+static JsonRpcParam toParam(lua_State *L, int idx) {
+  switch (lua_type(L, idx)) {
+    case LUA_TNUMBER: {
+      auto v = lua_tointeger(L, idx);
+      if (v >= INT_MIN && v <= INT_MAX) return (int)v;
+      return (int64_t)v;
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      auto s = lua_tolstring(L, idx, &len);
+      return std::string_view { s, len };
+    }
+    case LUA_TBOOLEAN:
+      return (bool)lua_toboolean(L, idx);
+    default:
+      return nullptr;
+  }
+}
+
+static void pushParam(lua_State *L, const JsonRpcParam &param) {
+  std::visit([&](auto&& arg) {
+    using T = std::decay_t<decltype(arg)>;
+    if constexpr (std::is_same_v<T, int> || std::is_same_v<T, int64_t>) {
+      lua_pushinteger(L, arg);
+    } else if constexpr (std::is_same_v<T, std::string_view>) {
+      lua_pushlstring(L, arg.data(), arg.size());
+    } else if constexpr (std::is_same_v<T, bool>) {
+      lua_pushboolean(L, arg);
+    } else if constexpr (std::is_same_v<T, std::span<const std::string_view>>) {
+      lua_createtable(L, arg.size(), 0);
+      for (size_t i = 0; i < arg.size(); i++) {
+        lua_pushlstring(L, arg[i].data(), arg[i].size());
+        lua_rawseti(L, -2, i + 1);
+      }
+    } else {
+      lua_pushnil(L);
+    }
+  }, param);
+}
+
+// upvalue 1: RpcMethodEntry*，upvalue 2: 方法名，upvalue 3: RpcStats*
+// lua_error会longjmp，所以C++对象都放在内层作用域里，出来之后再报错
+static int dispatch(lua_State *L) {
+  bool ok = true;
+  {
+    auto entry = static_cast<const RpcMethodEntry *>(lua_touserdata(L, lua_upvalueindex(1)));
+    auto stats = static_cast<RpcStats *>(lua_touserdata(L, lua_upvalueindex(3)));
+    auto start = RpcStats::sampleStart();
+    JsonRpcPacket pkt;
+    pkt.id = 0;
+    pkt.method = lua_tostring(L, lua_upvalueindex(2));
+
+    auto n = std::min(lua_gettop(L), 5);
+    pkt.param_count = n;
+    JsonRpcParam *params[] = { &pkt.param1, &pkt.param2, &pkt.param3, &pkt.param4, &pkt.param5 };
+    for (int i = 0; i < n; i++) {
+      *params[i] = toParam(L, i + 1);
+    }
+
+    try {
+      auto [success, result] = entry->method(pkt);
+      if (success) {
+        pushParam(L, result);
+      } else {
+        ok = false;
+        auto data = std::get_if<std::string_view>(&result);
+        lua_pushfstring(L, "%s: Invalid params%s%s", lua_tostring(L, lua_upvalueindex(2)),
+                        data ? ": " : "", data ? std::string { *data }.c_str() : "");
+      }
+    } catch (const std::exception &e) {
+      ok = false;
+      lua_pushfstring(L, "%s: %s", lua_tostring(L, lua_upvalueindex(2)), e.what());
+    }
+    stats->record(RpcStats::FromLua, entry->name, 0, 0, start);
+  }
+
+  if (!ok) return lua_error(L);
+  return 1;
+}
+
+static int traceback(lua_State *L) {
+  auto msg = lua_tostring(L, 1);
+  luaL_traceback(L, L, msg ? msg : "(error object is not a string)", 1);
+  return 1;
+}
+
+NativeLua::NativeLua(io_context &ctx, RpcStats &stats) : LuaInterface { stats }, io_ctx { ctx } {
+  L = luaL_newstate();
+  if (!L) {
+    spdlog::error("Cannot create lua_State");
+    return;
+  }
+  luaL_openlibs(L);
+
+  lua_createtable(L, 0, RpcDispatchers::ServerRpcMethods.size());
+  for (auto &entry : RpcDispatchers::ServerRpcMethods) {
+    lua_pushlightuserdata(L, (void *)&entry);
+    lua_pushlstring(L, entry.name.data(), entry.name.size());
+    lua_pushlightuserdata(L, &m_rpc_stats);
+    lua_pushcclosure(L, dispatch, 3);
+    lua_setfield(L, -2, std::string { entry.name }.c_str());
+  }
+  lua_setglobal(L, "fk_native");
+
+  // 子进程模式下这些是环境变量；这里别的线程也在跑，不能setenv，只好换掉os.getenv
+  auto disabled_packs = PackMan::instance().getDisabledPacks();
+  cJSON *json_array = cJSON_CreateArray();
+  for (const auto& pack : disabled_packs) {
+    cJSON_AddItemToArray(json_array, cJSON_CreateString(pack.c_str()));
+  }
+  char *json_string = cJSON_PrintUnformatted(json_array);
+  lua_createtable(L, 0, 2);
+  lua_pushstring(L, json_string);
+  lua_setfield(L, -2, "FK_DISABLED_PACKS");
+  lua_pushstring(L, "native");
+  lua_setfield(L, -2, "FK_RPC_MODE");
+  lua_setglobal(L, "fk_env");
+  free(json_string);
+  cJSON_Delete(json_array);
+
+  // 子进程是chdir进freekill-core里跑的，进程内只能改搜索路径
+  lua_pushstring(L, CoreRoot);
+  lua_setglobal(L, "FK_CORE_ROOT");
+  auto prelude = fmt::format(R"(
+    local getenv = os.getenv
+    os.getenv = function(k)
+      local v = fk_env[k]
+      if v ~= nil then return v end
+      return getenv(k)
+    end
+    package.path = "{0}?.lua;{0}?/init.lua;" .. package.path
+  )", CoreRoot);
+  if (luaL_dostring(L, prelude.c_str()) != LUA_OK) {
+    spdlog::error("Lua prelude failed: {}", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return;
+  }
+
+  lua_pushcfunction(L, traceback);
+  auto entry = fmt::format("{}lua/server/rpc/entry.lua", CoreRoot);
+  if (luaL_loadfile(L, entry.c_str()) != LUA_OK || lua_pcall(L, 0, 0, -2) != LUA_OK) {
+    spdlog::error("Cannot load {}: {}", entry, lua_tostring(L, -1));
+    lua_pop(L, 2);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "fk_rpc_methods");
+  if (!lua_istable(L, -1)) {
+    spdlog::error("{} does not support native mode (fk_rpc_methods is not set)", entry);
+    lua_pop(L, 1);
+    return;
+  }
+  methods_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  m_alive = true;
+  m_mem_kb = lua_gc(L, LUA_GCCOUNT, 0);
+}
+
+NativeLua::~NativeLua() {
+  if (!L) return;
+  if (m_alive) {
+    call("bye");
+  }
+  lua_close(L);
+}
+
+bool NativeLua::invoke(const char *func_name, JsonRpcParam *params, int count) {
+  lua_pushcfunction(L, traceback);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, methods_ref);
+  lua_getfield(L, -1, func_name);
+  lua_remove(L, -2);
+  if (!lua_isfunction(L, -1)) {
+    spdlog::warn("Lua method {} not found", func_name);
+    lua_pop(L, 2);
+    last_error = -32601;
+    return false;
+  }
+
+  for (int i = 0; i < count; i++) {
+    pushParam(L, params[i]);
+  }
+  last_error = 0;
+
+  auto start = RpcStats::sampleStart();
+  auto ret = lua_pcall(L, count, 1, -count - 2);
+  lua_remove(L, -2); // traceback
+  m_mem_kb = lua_gc(L, LUA_GCCOUNT, 0);
+  m_rpc_stats.record(RpcStats::ToLua, func_name, 0, 0, start);
+
+  if (ret != LUA_OK) {
+    last_error = -32603;
+    spdlog::error("Lua error in {}: {}", func_name, lua_tostring(L, -1));
+    lua_pop(L, 1);
+    if (ret == LUA_ERRMEM) {
+      kill("out of memory");
+    }
+    return false;
+  }
+  return true;
+}
+
+void NativeLua::kill(const char *reason) {
+  if (!m_alive) return;
+  m_alive = false;
+  spdlog::error("In-process Lua stopped: {}", reason);
+  if (died_callback) {
+    asio::post(io_ctx, died_callback);
+  }
+}
+
+void NativeLua::call(const char *func_name, JsonRpcParam param1, JsonRpcParam param2, JsonRpcParam param3) {
+  if (!m_alive) return;
+
+  // 和JsonRpc::notification一样，遇到第一个null就截断
+  JsonRpcParam params[] = { param1, param2, param3 };
+  int count = 0;
+  while (count < 3 && !std::holds_alternative<std::nullptr_t>(params[count])) count++;
+
+  if (invoke(func_name, params, count)) {
+    lua_pop(L, 1);
+  }
+}
+
+void NativeLua::callAsync(const char *func_name, Callback on_done,
+                          JsonRpcParam param1, JsonRpcParam param2, JsonRpcParam param3) {
+  if (!m_alive) {
+    if (on_done) {
+      JsonRpcPacket res;
+      res.error.code = -32000;
+      res.error.message = "Lua is not running";
+      on_done(res);
+    }
+    return;
+  }
+
+  JsonRpcParam params[] = { param1, param2, param3 };
+  int count = 0;
+  while (count < 3 && !std::holds_alternative<std::nullptr_t>(params[count])) count++;
+
+  if (!invoke(func_name, params, count)) {
+    if (on_done) {
+      JsonRpcPacket res;
+      res.error.code = last_error;
+      on_done(res);
+    }
+    return;
+  }
+  if (on_done) {
+    JsonRpcPacket res;
+    res.result = toParam(L, -1);
+    on_done(res);
+  }
+  lua_pop(L, 1);
+}
+
+size_t NativeLua::pendingCount() const {
+  return 0;
+}
+
+int NativeLua::lastError() const {
+  return last_error;
+}
+
+std::string NativeLua::getConnectionInfo() const {
+  if (!m_alive) return "in-process (died)";
+  return fmt::format("in-process (Lua mem = {:.2f} MiB)", m_mem_kb.load() / 1024.0);
+}
+
+uint64_t NativeLua::cpuTimeUs() const {
+  return 0;
+}
+
+bool NativeLua::alive() const {
+  return m_alive;
+}
+
+void NativeLua::setDiedCallback(std::function<void()> f) {
+  died_callback = std::move(f);
+}
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// 进程内的Lua：每个RoomThread一个lua_State，Lua调C++时直接调ServerRpcMethods里的函数，
+// 省掉序列化、系统调用和每个lua5.4进程的内存。代价是Lua崩了会把服务器一起带走，
+// 所以管道模式仍然保留，由配置项luaMode选择
+#pragma once
+
+#include "server/rpc-lua/lua-interface.h"
+
+struct lua_State;
+
+class NativeLua : public LuaInterface {
+public:
+  using io_context = boost::asio::io_context;
+
+  NativeLua(io_context &, RpcStats &stats);
+  NativeLua(NativeLua &) = delete;
+  NativeLua(NativeLua &&) = delete;
+  ~NativeLua();
+
+  void call(const char *func_name, JsonRpc::JsonRpcParam param1 = nullptr,
+    JsonRpc::JsonRpcParam param2 = nullptr,
+    JsonRpc::JsonRpcParam param3 = nullptr) override;
+
+  // 进程内没有管道可等，直接执行完再回调
+  void callAsync(const char *func_name, Callback on_done,
+    JsonRpc::JsonRpcParam param1 = nullptr,
+    JsonRpc::JsonRpcParam param2 = nullptr,
+    JsonRpc::JsonRpcParam param3 = nullptr) override;
+
+  size_t pendingCount() const override;
+  int lastError() const override;
+
+  std::string getConnectionInfo() const override;
+  uint64_t cpuTimeUs() const override;
+
+  bool alive() const override;
+
+  void setDiedCallback(std::function<void()> f) override;
+
+private:
+  io_context &io_ctx;
+  lua_State *L = nullptr;
+  int methods_ref = -1;  // 注册表里的fk_rpc_methods
+  // 这两个shell线程会读
+  std::atomic<bool> m_alive = false;
+  std::atomic<int> m_mem_kb = 0;
+  int last_error = 0;
+  std::function<void()> died_callback;
+
+  // 调用Lua那边注册的方法，返回值留在栈顶；失败返回false
+  bool invoke(const char *func_name, JsonRpc::JsonRpcParam *params, int count);
+  void kill(const char *reason);
+};
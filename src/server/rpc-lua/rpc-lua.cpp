@@ -5,124 +5,126 @@
 #include "server/rpc-lua/jsonrpc.h"
 
 #include "server/gamelogic/rpc-dispatchers.h"
+#include "server/rpc-lua/transport.h"
 
 #include "core/util.h"
 
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <cjson/cJSON.h>
 
 using namespace JsonRpc;
 namespace asio = boost::asio;
 
+// 以下几个函数把消息编码进buf，最后整体一次write出去
+static inline void appendRaw(std::string &buf, const char *data, size_t len) {
+  buf.append(data, len);
+}
+
+static inline void appendHead(std::string &buf, uint64_t value, u_char major) {
+  u_char head[10];
+  auto len = cbor_encode_uint(value, head, 10);
+  head[0] += major;
+  buf.append((char *)head, len);
+}
+
 // 传过去的算上call和返回值只有int bytes和null... 毁灭吧
-static void sendParam(asio::posix::stream_descriptor &file, JsonRpcParam &param) {
-  u_char buf[10]; size_t buflen;
+static void appendParam(std::string &buf, JsonRpcParam &param) {
   std::visit([&](auto&& arg) {
     using T = std::decay_t<decltype(arg)>;
-    if constexpr (std::is_same_v<T, int>) {
+    if constexpr (std::is_same_v<T, int> || std::is_same_v<T, int64_t>) {
       if (arg >= 0) {
-        buflen = cbor_encode_uint(arg, buf, 10);
+        appendHead(buf, arg, 0x00);
       } else {
-        buflen = cbor_encode_negint(-1-arg, buf, 10);
+        appendHead(buf, -1-(int64_t)arg, 0x20);
       }
-      file.write_some(asio::const_buffer(buf, buflen));
-    } else if constexpr (std::is_same_v<T, std::string_view> || std::is_same_v<T, std::string>) {
-      buflen = cbor_encode_uint(arg.size(), buf, 10);
-      buf[0] += 0x40;
-      file.write_some(asio::const_buffer(buf, buflen));
-      file.write_some(asio::const_buffer(arg.data(), arg.size()));
+    } else if constexpr (std::is_same_v<T, std::string_view>) {
+      appendHead(buf, arg.size(), 0x40);
+      appendRaw(buf, arg.data(), arg.size());
     } else if constexpr (std::is_same_v<T, bool>) {
-      file.write_some(asio::const_buffer(arg ? "\xF5" : "\xF4", 1));
+      appendRaw(buf, arg ? "\xF5" : "\xF4", 1);
     } else if constexpr (std::is_same_v<T, std::nullptr_t>) {
-      file.write_some(asio::const_buffer("\xF6", 1));
+      appendRaw(buf, "\xF6", 1);
+    } else if constexpr (std::is_same_v<T, std::span<const std::string_view>>) {
+      appendHead(buf, arg.size(), 0x80);
+      for (auto &s : arg) {
+        appendHead(buf, s.size(), 0x40);
+        appendRaw(buf, s.data(), s.size());
+      }
     }
   }, param);
 }
 
 // request: { jsonRpc, method, params, id }
-static void sendRequest(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
-  u_char buf[10]; size_t buflen;
+static void encodeRequest(std::string &buf, JsonRpcPacket &pkt) {
   // { jsonRpc: '2.0', method: '
-  file.write_some(asio::const_buffer("\xa4\x18\x64\x43\x32\x2e\x30\x18\x65", 9));
-  buflen = cbor_encode_uint(pkt.method.size(), buf, 10);
-  buf[0] += 0x40;
+  appendRaw(buf, "\xa4\x18\x64\x43\x32\x2e\x30\x18\x65", 9);
   // <method>',
-  file.write_some(asio::const_buffer(buf, buflen));
-  file.write_some(asio::const_buffer(pkt.method.data(), pkt.method.size()));
+  appendHead(buf, pkt.method.size(), 0x40);
+  appendRaw(buf, pkt.method.data(), pkt.method.size());
   // id:
-  buflen = cbor_encode_uint(pkt.id, buf, 10);
-  file.write_some(asio::const_buffer("\x18\x68", 2));
-  file.write_some(asio::const_buffer(buf, buflen));
+  appendRaw(buf, "\x18\x68", 2);
+  appendHead(buf, pkt.id, 0x00);
   // params + arr head
   size_t i = pkt.param_count;
-  buflen = cbor_encode_uint(i, buf, 10);
-  buf[0] += 0x80;
-  file.write_some(asio::const_buffer("\x18\x66", 2));
-  file.write_some(asio::const_buffer(buf, buflen));
+  appendRaw(buf, "\x18\x66", 2);
+  appendHead(buf, i, 0x80);
 
   if (i == 0) return;
-  sendParam(file, pkt.param1);
+  appendParam(buf, pkt.param1);
   i--;
 
   if (i == 0) return;
-  sendParam(file, pkt.param2);
+  appendParam(buf, pkt.param2);
   i--;
 
   if (i == 0) return;
-  sendParam(file, pkt.param3);
+  appendParam(buf, pkt.param3);
 }
 
 // response: { jsonRpc, result, id }
-static void sendResponse(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
-  u_char buf[10]; size_t buflen;
+static void encodeResponse(std::string &buf, JsonRpcPacket &pkt) {
   // { jsonRpc: '2.0', id:
-  file.write_some(asio::const_buffer("\xa3\x18\x64\x43\x32\x2e\x30\x18\x68", 9));
+  appendRaw(buf, "\xa3\x18\x64\x43\x32\x2e\x30\x18\x68", 9);
 
   // id
-  buflen = cbor_encode_uint(pkt.id, buf, 10);
-  file.write_some(asio::const_buffer(buf, buflen));
+  appendHead(buf, pkt.id, 0x00);
 
   // result
-  file.write_some(asio::const_buffer("\x18\x69", 2));
-  sendParam(file, pkt.result);
+  appendRaw(buf, "\x18\x69", 2);
+  appendParam(buf, pkt.result);
 }
 
 // response: { jsonRpc, error, [id] }
-static void sendError(asio::posix::stream_descriptor &file, JsonRpcPacket &pkt) {
-  u_char buf[10]; size_t buflen;
-
+static void encodeError(std::string &buf, JsonRpcPacket &pkt) {
   if (pkt.id < 0) {
-    file.write_some(asio::const_buffer("\xa2", 1));
+    appendRaw(buf, "\xa2", 1);
   } else {
-    file.write_some(asio::const_buffer("\xa3", 1));
+    appendRaw(buf, "\xa3", 1);
   }
 
   // { jsonRpc: '2.0',
-  file.write_some(asio::const_buffer("\x18\x64\x43\x32\x2e\x30", 6));
+  appendRaw(buf, "\x18\x64\x43\x32\x2e\x30", 6);
 
   // [id]
   if (pkt.id >= 0) {
-    buflen = cbor_encode_uint(pkt.id, buf, 10);
-    file.write_some(asio::const_buffer("\x18\x68", 2));
-    file.write_some(asio::const_buffer(buf, buflen));
+    appendRaw(buf, "\x18\x68", 2);
+    appendHead(buf, pkt.id, 0x00);
   }
 
   // error: { code:
-  file.write_some(asio::const_buffer("\x18\x67\xA3\x18\xC8", 5));
-  buflen = cbor_encode_negint(pkt.error.code, buf, 10);
-  file.write_some(asio::const_buffer(buf, buflen));
+  appendRaw(buf, "\x18\x67\xA3\x18\xC8", 5);
+  appendHead(buf, pkt.error.code, 0x20);
 
   // msg:
-  file.write_some(asio::const_buffer("\x18\xC9", 2));
-  buflen = cbor_encode_uint(pkt.error.message.size(), buf, 10);
-  buf[0] += 0x40;
-  file.write_some(asio::const_buffer(buf, buflen));
-  file.write_some(asio::const_buffer(pkt.error.message.data(), pkt.error.message.size()));
+  appendRaw(buf, "\x18\xC9", 2);
+  appendHead(buf, pkt.error.message.size(), 0x40);
+  appendRaw(buf, pkt.error.message.data(), pkt.error.message.size());
 
   // data:
-  file.write_some(asio::const_buffer("\x18\xCA", 2));
-  sendParam(file, pkt.error.data);
+  appendRaw(buf, "\x18\xCA", 2);
+  appendParam(buf, pkt.error.data);
 }
 
 struct RpcPacketBuilder {
@@ -386,15 +388,13 @@ static void init_callbacks() {
   };
 }
 
-static cbor_decoder_status readJsonRpcPacket(cbor_data &cbuf, size_t &len, JsonRpcPacket &packet) {
+// 从cbuf接着builder上次停下的地方往后解，一次只读一个item
+// 数据不够时停在最后一个完整的item之后，required是下一个item总共需要的字节数
+static cbor_decoder_status readJsonRpcPacket(cbor_data &cbuf, size_t &len,
+                                             RpcPacketBuilder &builder, size_t &required) {
   std::call_once(callbacks_flag, init_callbacks);
-  RpcPacketBuilder builder { packet };
-  auto cbufsave = cbuf;
-  auto lensave = len;
 
   while (true) {
-    // 基于callbacks，边读缓冲区边构造packet并进一步调用回调处理packet
-    // 下面这个函数一次只读一个item
     auto decode_result = cbor_stream_decode(cbuf, len, &callbacks, &builder);
 
     if (decode_result.read != 0) {
@@ -402,17 +402,40 @@ static cbor_decoder_status readJsonRpcPacket(cbor_data &cbuf, size_t &len, JsonR
       len -= decode_result.read;
     } else {
       // NEDATA or ERROR
-      cbuf = cbufsave;
-      len = lensave;
+      required = decode_result.required;
       return decode_result.status;
     }
 
     if (builder.state == RpcPacketBuilder::FIN) return CBOR_DECODER_FINISHED;
+    if (builder.state == RpcPacketBuilder::ERROR) return CBOR_DECODER_ERROR;
   }
 }
 
-RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
-  child_stdin { ctx }, child_stdout { ctx }
+// 缓冲区搬家后，把解析到一半的包里指向旧地址的string_view挪到新地址
+static void rebasePacket(JsonRpcPacket &pkt, const unsigned char *old_base, size_t len,
+                         const unsigned char *new_base) {
+  auto old_begin = (const char *)old_base;
+  auto rebase = [&](std::string_view &sv) {
+    if (sv.data() >= old_begin && sv.data() < old_begin + len) {
+      sv = { (const char *)new_base + (sv.data() - old_begin), sv.size() };
+    }
+  };
+  auto rebaseParam = [&](JsonRpcParam &param) {
+    if (auto sv = std::get_if<std::string_view>(&param)) rebase(*sv);
+  };
+
+  rebase(pkt.method);
+  rebase(pkt.error.message);
+  rebaseParam(pkt.param1);
+  rebaseParam(pkt.param2);
+  rebaseParam(pkt.param3);
+  rebaseParam(pkt.param4);
+  rebaseParam(pkt.param5);
+}
+
+RpcLua::RpcLua(asio::io_context &ctx, RpcStats &stats, int shm_ring_size) : LuaInterface { stats }, io_ctx { ctx },
+  child_stdin { ctx }, child_stdout { ctx }, child_pidfd { ctx },
+  builder { std::make_unique<RpcPacketBuilder>(parsing_pkt) }
 {
   int stdin_pipe[2];  // [0]=read, [1]=write
   int stdout_pipe[2]; // [0]=read, [1]=write
@@ -420,6 +443,12 @@ RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
     throw std::runtime_error("Failed to create pipes");
   }
 
+  // 共享内存得在fork之前建好，子进程才能继承那几个fd（它们默认CLOEXEC，子进程里再放开）
+  std::unique_ptr<ShmTransport> shm;
+  if (shm_ring_size > 0) {
+    shm = ShmTransport::create(io_ctx, shm_ring_size);
+  }
+
   pid_t pid = fork();
   if (pid == 0) { // child
     // 关闭父进程用的 pipe 端
@@ -454,6 +483,11 @@ RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
     cJSON_Delete(json_array);
 
     ::setenv("FK_RPC_MODE", "cbor", 1);
+    if (shm) {
+      // Lua那边认得的话会在hello里回一个"shm"
+      ::setenv("FK_RPC_SHM", shm->childEnv().c_str(), 1);
+      shm->inheritInChild();
+    }
     ::execlp("lua5.4", "lua5.4", "lua/server/rpc/entry.lua", nullptr);
 
     ::_exit(EXIT_FAILURE);
@@ -471,13 +505,33 @@ RpcLua::RpcLua(asio::io_context &ctx) : io_ctx { ctx },
   child_stdin = { io_ctx, stdin_pipe[1] };
   child_stdout = { io_ctx, stdout_pipe[0] };
 
+  watchChild();
+
+  transport = std::make_unique<PipeTransport>(child_stdin, child_stdout);
   wait(WaitForNotification, "hello", 0);
+
+  if (shm && hello_transport == "shm") {
+    shm->attach(child_stdout);
+    transport = std::move(shm);
+  }
+  if (shm_ring_size > 0) {
+    spdlog::info("Lua process {} uses {} transport", child_pid, transport->name());
+  }
 }
 
 RpcLua::~RpcLua() {
-  if (!alive()) return;
+  if (!alive()) {
+    // 没有pidfd时可能根本没走onChildDied，这里兜底
+    failPendingCalls();
+    // 已经退出的话顺手收尸，免得留下僵尸进程
+    int wstatus;
+    ::waitpid(child_pid, &wstatus, WNOHANG);
+    return;
+  }
 
+  // bye等返回值的时候顺带收掉先前异步调用的返回值，剩下的就等不到了
   call("bye");
+  failPendingCalls();
 
   int wstatus;
   int w = waitpid(child_pid, &wstatus, WUNTRACED);
@@ -496,68 +550,163 @@ RpcLua::~RpcLua() {
 }
 
 void RpcLua::wait(WaitType waitType, const char *method, int id) {
-  JsonRpcPacket received_pkt;
+  // 上次读多了的部分可能已经包含想要的包
+  if (processBuffered(waitType, method, id)) return;
 
   while (child_stdout.is_open() && alive()) {
-    received_pkt.reset();
+    auto writable = prepareRead();
+    if (writable == 0) break;
+
     boost::system::error_code ec;
-    auto read_sz = child_stdout.read_some(asio::buffer(buffer, max_length), ec);
+    auto read_sz = transport->readSome((char *)read_buf.writePtr(), writable, ec);
     if (ec) {
       spdlog::error("Error occured when reading child stdin: {}", ec.message());
       break;
     }
 
-    cborBuffer.insert(cborBuffer.end(), buffer, buffer + read_sz);
-    cbor_data cbuf = (cbor_data)cborBuffer.data(); size_t len = cborBuffer.size();
+    read_buf.commit(read_sz);
+    if (processBuffered(waitType, method, id)) return;
+  }
 
-    auto stat = readJsonRpcPacket(cbuf, len, received_pkt);
+#ifdef RPC_DEBUG
+  spdlog::debug("Me <-- IO read timeout. Is Lua process died?");
+#endif
+}
+
+size_t RpcLua::prepareRead() {
+  // 大的item一次把空间备够，之后的数据直接读到位，不会反复挪
+  auto want = std::max<size_t>(min_read_length, missing_bytes);
+  auto writable = read_buf.prepare(want, max_read_capacity);
+  if (writable == 0) {
+    spdlog::error("Lua RPC packet exceeds {} bytes, dropping buffered data", (size_t)max_read_capacity);
+    read_buf.consume(read_buf.size());
+    builder->reset();
+    parse_offset = 0;
+    missing_bytes = 0;
+    writable = read_buf.prepare(want, max_read_capacity);
+  }
+  return writable;
+}
+
+bool RpcLua::processBuffered(WaitType waitType, const char *method, int id) {
+  while (read_buf.size() > parse_offset) {
+    auto base = read_buf.data();
+    if (parse_offset > 0 && base != parse_base) {
+      rebasePacket(parsing_pkt, parse_base, parse_offset, base);
+    }
+    parse_base = base;
+
+    cbor_data cbuf = base + parse_offset;
+    size_t len = read_buf.size() - parse_offset;
+    size_t required = 0;
+    auto stat = readJsonRpcPacket(cbuf, len, *builder, required);
+    parse_offset = cbuf - base;
 
     if (stat == CBOR_DECODER_ERROR) {
-      cborBuffer.clear();
-      break;
-    } else {
-      cborBuffer.clear();
-      cborBuffer.insert(cborBuffer.end(), cbuf, cbuf + len);
-      if (stat == CBOR_DECODER_NEDATA) continue;
+      read_buf.consume(read_buf.size());
+      builder->reset();
+      parse_offset = 0;
+      missing_bytes = 0;
+      return waitType != WaitForNothing;
+    } else if (stat == CBOR_DECODER_NEDATA) {
+      missing_bytes = required > len ? required - len : 0;
+      return false;
     }
 
-    if ((waitType == WaitForResponse && received_pkt.id == id && received_pkt.method == "" && received_pkt.error.code == 0) ||
-      (waitType == WaitForNotification && received_pkt.id == -1 && received_pkt.method == method)) {
+    // 一个包解完了，先从缓冲区里拿掉，处理过程中嵌套的call()会接着往后读；
+    // 钉住缓冲区，保证这个包里的string_view在处理完之前一直有效
+    JsonRpcPacket received_pkt = std::move(parsing_pkt);
+    last_packet_bytes = parse_offset;
+    read_buf.consume(parse_offset);
+    builder->reset();
+    parse_offset = 0;
+    missing_bytes = 0;
+
+    read_buf.pin();
+    auto done = handlePacket(received_pkt, waitType, method, id);
+    read_buf.unpin();
+    if (done) return true;
+  }
+
+  return false;
+}
+
+bool RpcLua::handlePacket(JsonRpcPacket &received_pkt, WaitType waitType, const char *method, int id) {
+  if (received_pkt.method == "" && received_pkt.id >= 0) {
+    // 返回值，先看看是不是哪个异步请求的
+    auto it = std::find_if(pending_calls.begin(), pending_calls.end(),
+                           [&](const PendingCall &c) { return c.id == received_pkt.id; });
+    if (it != pending_calls.end()) {
+      auto call = std::move(*it);
+      pending_calls.erase(it);
+      m_rpc_stats.record(RpcStats::ToLua, call.method, call.bytes_sent,
+                         last_packet_bytes, call.sample_start);
+      if (received_pkt.error.code != 0) {
+        spdlog::warn("RPC call failed! id={} method={} ec={} msg={}", call.id, call.method, received_pkt.error.code, received_pkt.error.message);
+      }
+      if (call.on_done) {
+        call.on_done(received_pkt);
+      }
+    }
+  }
+
+  if ((waitType == WaitForResponse && received_pkt.id == id && received_pkt.method == "" && received_pkt.error.code == 0) ||
+    (waitType == WaitForNotification && received_pkt.id == -1 && received_pkt.method == method)) {
+    if (received_pkt.method == "hello" && received_pkt.param_count > 0) {
+      // hello的参数表示Lua愿意用哪种方式通信
+      if (auto sv = std::get_if<std::string_view>(&received_pkt.param1)) {
+        hello_transport = *sv;
+      }
+    }
 #ifdef RPC_DEBUG
-      spdlog::debug("Me <-- returned {}", toHex({ buffer, read_sz }));
+    spdlog::debug("Me <-- returned");
 #endif
-      // 并不关心lua返回了啥；那为什么还要去读取
-      return;
-    } else if (received_pkt.error.code != 0) {
-      spdlog::warn("RPC call failed! id={} method={} ec={} msg={}", id, method, received_pkt.error.code, received_pkt.error.message);
-      return;
-    } else {
+    // 并不关心lua返回了啥；那为什么还要去读取
+    last_error = 0;
+    return true;
+  } else if (received_pkt.error.code != 0) {
+    if (waitType == WaitForNothing || (received_pkt.id >= 0 && received_pkt.id != id)) {
+      // 异步请求的错误上面已经报过了
+      return false;
+    }
+    spdlog::warn("RPC call failed! id={} method={} ec={} msg={}", id, method, received_pkt.error.code, received_pkt.error.message);
+    last_error = received_pkt.error.code;
+    return true;
+  } else if (received_pkt.method == "") {
+    // 别的请求的返回值
+    return false;
+  } else {
 #ifdef RPC_DEBUG
-      spdlog::debug("  Me <-- {} {}", received_pkt.method, toHex({ buffer, read_sz }));
+    spdlog::debug("  Me <-- {}", received_pkt.method);
 #endif
-      auto res = JsonRpc::handleRequest(RpcDispatchers::ServerRpcMethods, received_pkt);
-      if (res) {
-        if (res->error.code < 0) {
-          sendError(child_stdin, *res);
+    auto start = RpcStats::sampleStart();
+    auto bytes_received = last_packet_bytes;
+    auto res = JsonRpc::handleRequest(RpcDispatchers::ServerRpcMethods, received_pkt);
+    size_t bytes_sent = 0;
+    if (res) {
+      if (res->error.code < 0) {
+        encodeError(send_buffer, *res);
+        bytes_sent = send_buffer.size();
+        flushSendBuffer();
 #ifdef RPC_DEBUG
-          spdlog::debug("  Me --> returned an error");
+        spdlog::debug("  Me --> returned an error");
 #endif
-        } else if (res->id > 0) {
-          sendResponse(child_stdin, *res);
+      } else if (res->id > 0) {
+        encodeResponse(send_buffer, *res);
+        bytes_sent = send_buffer.size();
+        flushSendBuffer();
 #ifdef RPC_DEBUG
-          spdlog::debug("  Me --> returned some value");
+        spdlog::debug("  Me --> returned some value");
 #endif
-        } else {
-          // 爆炸罢
-          throw "unknown res type";
-        }
+      } else {
+        // 爆炸罢
+        throw "unknown res type";
       }
     }
+    m_rpc_stats.record(RpcStats::FromLua, received_pkt.method, bytes_received, bytes_sent, start);
   }
 
-#ifdef RPC_DEBUG
-  spdlog::debug("Me <-- IO read timeout. Is Lua process died?");
-#endif
+  return false;
 }
 
 void RpcLua::call(const char *func_name, JsonRpcParam param1, JsonRpcParam param2, JsonRpcParam param3) {
@@ -572,15 +721,113 @@ void RpcLua::call(const char *func_name, JsonRpcParam param1, JsonRpcParam param
     return;
   }
 
+  last_error = -32000; // 没等到返回值就当是服务器错误
+  auto start = RpcStats::sampleStart();
   auto req = JsonRpc::request(func_name, param1, param2, param3);
   auto id = req.id;
-  sendRequest(child_stdin, req);
+  encodeRequest(send_buffer, req);
+  auto bytes_sent = send_buffer.size();
+  flushSendBuffer();
 
   wait(WaitForResponse, func_name, id);
+  m_rpc_stats.record(RpcStats::ToLua, func_name, bytes_sent,
+                     last_error == 0 ? last_packet_bytes : 0, start);
+}
+
+void RpcLua::callAsync(const char *func_name, Callback on_done,
+                       JsonRpcParam param1, JsonRpcParam param2, JsonRpcParam param3) {
+#ifdef RPC_DEBUG
+  spdlog::debug("L->callAsync({})", func_name);
+#endif
+
+  if (!alive()) {
+    failCall(-1, on_done);
+    return;
+  }
+
+  // 太多请求没回来的话，先等最早的那个，给Lua一点喘息时间
+  while (pending_calls.size() >= max_pending_calls && alive()) {
+    auto &oldest = pending_calls.front();
+    auto oldest_id = oldest.id;
+    wait(WaitForResponse, oldest.method, oldest_id);
+    if (!pending_calls.empty() && pending_calls.front().id == oldest_id) {
+      // 出错了也不再等它
+      auto call = std::move(pending_calls.front());
+      pending_calls.pop_front();
+      failCall(call.id, call.on_done);
+    }
+  }
+
+  auto start = RpcStats::sampleStart();
+  auto req = JsonRpc::request(func_name, param1, param2, param3);
+  encodeRequest(send_buffer, req);
+  pending_calls.push_back({ req.id, func_name, std::move(on_done), start, send_buffer.size() });
+  flushSendBuffer();
+
+  watchOutput();
+}
+
+size_t RpcLua::pendingCount() const {
+  return pending_calls.size();
+}
+
+int RpcLua::lastError() const {
+  return last_error;
+}
+
+// 有数据可读时才回调，这时候读不会卡住io_ctx
+void RpcLua::watchOutput() {
+  if (watching || !child_stdout.is_open()) return;
+  watching = true;
+  // 共享内存那边可能直接post一个成功的回调，光看ec不够，还要看自己还在不在
+  transport->asyncWaitReadable([this, life = std::weak_ptr { m_life }](const boost::system::error_code &ec) {
+    if (ec == asio::error::operation_aborted || life.expired()) return;
+    watching = false;
+    if (ec) return;
+    drainOutput();
+  });
+}
+
+void RpcLua::drainOutput() {
+  // 数据可能已经被某个同步的call读走了，所以这里不能阻塞；
+  // 有多少读多少，否则剩下的部分不会再触发可读事件
+  while (true) {
+    auto writable = prepareRead();
+    if (writable == 0) return;
+
+    boost::system::error_code ec;
+    auto read_sz = transport->tryRead((char *)read_buf.writePtr(), writable, ec);
+    if (ec) {
+      spdlog::error("Error occured when reading child stdin: {}", ec.message());
+      return;
+    }
+    if (read_sz == 0) break;
+
+    read_buf.commit(read_sz);
+    processBuffered(WaitForNothing, "", -1);
+  }
+
+  // 还有请求没回来，Lua处理它们的时候可能还会主动找我们，继续盯着
+  if (!pending_calls.empty()) {
+    watchOutput();
+  }
+}
+
+void RpcLua::flushSendBuffer() {
+  boost::system::error_code ec;
+  transport->write(send_buffer.data(), send_buffer.size(), ec);
+  if (ec) {
+    spdlog::error("Error occured when writing child stdin: {}", ec.message());
+  }
+  // clear不释放容量，下次接着用
+  send_buffer.clear();
 }
 
 std::string RpcLua::getConnectionInfo() const {
   auto ret = fmt::format("PID {}", child_pid);
+  if (transport && std::string_view { transport->name() } != "pipe") {
+    ret += fmt::format(" via {}", transport->name());
+  }
   if (alive()) {
     std::ifstream f { fmt::format("/proc/{}/statm", child_pid) };
     if (f.is_open()) {
@@ -607,7 +854,89 @@ std::string RpcLua::getConnectionInfo() const {
   return ret;
 }
 
+uint64_t RpcLua::cpuTimeUs() const {
+  std::ifstream f { fmt::format("/proc/{}/stat", child_pid) };
+  std::string line;
+  if (!f.is_open() || !std::getline(f, line)) return 0;
+
+  // 进程名里可能有空格，从最后一个')'往后数：state是第3项，utime和stime是第14、15项
+  auto pos = line.rfind(')');
+  if (pos == std::string::npos) return 0;
+  std::istringstream iss(line.substr(pos + 2));
+  std::string field;
+  for (int i = 3; i < 14; i++) iss >> field;
+  uint64_t utime = 0, stime = 0;
+  iss >> utime >> stime;
+
+  static const long ticks = sysconf(_SC_CLK_TCK);
+  return (utime + stime) * 1000000 / ticks;
+}
+
 bool RpcLua::alive() const {
+  if (has_pidfd) {
+    return m_alive.load(std::memory_order_relaxed);
+  }
+
+  // 内核太老不支持pidfd_open的话只能去/proc看了
   auto procDir = fmt::format("/proc/{}/exe", child_pid);
   return std::filesystem::exists(procDir);
 }
+
+void RpcLua::setDiedCallback(std::function<void()> f) {
+  died_callback = std::move(f);
+}
+
+void RpcLua::watchChild() {
+#ifdef SYS_pidfd_open
+  int fd = ::syscall(SYS_pidfd_open, child_pid, 0);
+  if (fd < 0) {
+    spdlog::warn("pidfd_open() failed: {}. Falling back to polling /proc.", strerror(errno));
+    return;
+  }
+
+  child_pidfd = { io_ctx, fd };
+  has_pidfd = true;
+  child_pidfd.async_wait(stream_descriptor::wait_read, [this, life = std::weak_ptr { m_life }](const boost::system::error_code &ec) {
+    if (ec || life.expired()) return;
+    onChildDied();
+  });
+#endif
+}
+
+void RpcLua::onChildDied() {
+  m_alive = false;
+  spdlog::error("Lua process {} exited unexpectedly", child_pid);
+
+  // 这些请求再也不会有返回值了
+  failPendingCalls();
+
+  if (died_callback) died_callback();
+}
+
+void RpcLua::detach() {
+  if (!m_life) return;
+  m_life = nullptr;
+  failPendingCalls();
+
+  boost::system::error_code ignored;
+  child_pidfd.close(ignored);
+  if (transport) transport->close();
+}
+
+void RpcLua::failPendingCalls() {
+  // on_done里可能又发起callAsync，先整个换出来
+  auto calls = std::move(pending_calls);
+  pending_calls.clear();
+  for (auto &call : calls) {
+    failCall(call.id, call.on_done);
+  }
+}
+
+void RpcLua::failCall(int id, const Callback &on_done) {
+  if (!on_done) return;
+  JsonRpcPacket res;
+  res.id = id;
+  res.error.code = -32000;
+  res.error.message = "Lua process is not running";
+  on_done(res);
+}
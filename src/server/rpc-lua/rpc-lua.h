@@ -2,27 +2,48 @@
 
 #pragma once
 
-#include "server/rpc-lua/jsonrpc.h"
+#include "server/rpc-lua/lua-interface.h"
+#include "core/buffer.h"
 
-class RpcLua {
+class RpcTransport;
+struct RpcPacketBuilder;
+
+class RpcLua : public LuaInterface {
 public:
   using io_context = boost::asio::io_context;
   using stream_descriptor = boost::asio::posix::stream_descriptor;
   using tcp = boost::asio::ip::tcp;
   using udp = boost::asio::ip::udp;
 
-  explicit RpcLua(io_context &);
+  // shm_ring_size即配置项luaShmRingSize，0表示只用管道；在RoomThread里构造，不能自己去读配置
+  RpcLua(io_context &, RpcStats &stats, int shm_ring_size);
   RpcLua(RpcLua &) = delete;
   RpcLua(RpcLua &&) = delete;
   ~RpcLua();
 
   void call(const char *func_name, JsonRpc::JsonRpcParam param1 = nullptr,
     JsonRpc::JsonRpcParam param2 = nullptr,
-    JsonRpc::JsonRpcParam param3 = nullptr);
+    JsonRpc::JsonRpcParam param3 = nullptr) override;
+
+  // 异步调用：请求写出后立即返回，返回值到达时调用on_done（可以为空）
+  // 返回值在下一次call或者io_ctx发现管道可读时处理
+  void callAsync(const char *func_name, Callback on_done,
+    JsonRpc::JsonRpcParam param1 = nullptr,
+    JsonRpc::JsonRpcParam param2 = nullptr,
+    JsonRpc::JsonRpcParam param3 = nullptr) override;
+
+  size_t pendingCount() const override;
+  int lastError() const override;
 
-  std::string getConnectionInfo() const;
+  std::string getConnectionInfo() const override;
+  uint64_t cpuTimeUs() const override;
 
-  bool alive() const;
+  bool alive() const override;
+
+  // Lua进程退出时在io_ctx中调用一次
+  void setDiedCallback(std::function<void()> f) override;
+
+  void detach() override;
 
 private:
   io_context &io_ctx;
@@ -31,13 +52,74 @@ private:
   stream_descriptor child_stdin;   // 父进程写入子进程 stdin
   stream_descriptor child_stdout;  // 父进程读取子进程 stdout
 
+  // 读写都经过它；默认是上面两根管道
+  std::unique_ptr<RpcTransport> transport;
+  std::string hello_transport;
+
+  // 子进程退出时pidfd变为可读，不用每次都去/proc里面看
+  stream_descriptor child_pidfd;
+  bool has_pidfd = false;
+  std::atomic<bool> m_alive = true;
+  std::function<void()> died_callback;
+  // 挂在io_ctx上的回调只拿它的weak_ptr，detach或者析构之后再跑到就直接返回
+  std::shared_ptr<bool> m_life = std::make_shared<bool>(true);
+  void watchChild();
+  void onChildDied();
+  // 等不到返回值的异步调用用-32000结束掉，让on_done知道
+  void failPendingCalls();
+  static void failCall(int id, const Callback &on_done);
+
   enum WaitType {
     WaitForNotification,
     WaitForResponse,
+    WaitForNothing, // 只处理已经到达的数据
   };
   void wait(WaitType waitType, const char *method, int id);
+  bool handlePacket(JsonRpc::JsonRpcPacket &pkt, WaitType waitType, const char *method, int id);
+  // 解析并处理read_buf里所有完整的包，返回true表示等到了想要的包
+  bool processBuffered(WaitType waitType, const char *method, int id);
+  // 给下一次读准备空间，返回可写字节数；0表示包太大，已经放不下了
+  size_t prepareRead();
+
+  // 已发出但还没收到返回值的异步请求，按发出顺序排列
+  struct PendingCall {
+    int id;
+    const char *method; // 都是字符串字面量
+    Callback on_done;
+    int64_t sample_start;  // RpcStats::sampleStart()的返回值
+    size_t bytes_sent;
+  };
+  std::deque<PendingCall> pending_calls;
+  int last_error = 0;
+  // 超过这个数量时先同步等最早的那个返回，免得管道被塞满
+  enum { max_pending_calls = 64 };
+
+  // 不在call里面时，由io_ctx监视Lua的输出（异步调用的返回值、Lua主动发来的请求）
+  bool watching = false;
+  void watchOutput();
+  void drainOutput();
+
+  // 发送缓冲区，一条消息编码完后一次写出
+  std::string send_buffer;
+  void flushSendBuffer();
+
+  // 管道/共享内存里的数据直接读进这里，包里的string_view都指向它
+  // 平时32K；碰到大的包（比如整个房间的数据）按需要扩容
+  enum {
+    initial_length = 32768,
+    min_read_length = 4096,
+    max_read_capacity = 64 * 1024 * 1024,
+  };
+  ReadBuffer read_buf { initial_length };
 
-  enum { max_length = 32768 };
-  char buffer[max_length];
-  std::vector<unsigned char> cborBuffer;
+  // 解析到一半的包：数据不够时保留解析状态，下次从parse_offset接着解，
+  // 不必从包头重新来过。parse_base用来发现缓冲区搬家，搬了就把已解出的string_view挪过去
+  JsonRpc::JsonRpcPacket parsing_pkt;
+  std::unique_ptr<RpcPacketBuilder> builder;
+  size_t parse_offset = 0;
+  // 最近一个解完的包有多少字节，给RpcStats用
+  size_t last_packet_bytes = 0;
+  const unsigned char *parse_base = nullptr;
+  // 当前这个item还差多少字节，读的时候至少准备这么多空间
+  size_t missing_bytes = 0;
 };
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/rpc-lua/rpc-stats.h"
+
+std::atomic<bool> RpcStats::s_enabled = true;
+std::atomic<int> RpcStats::s_sample_rate = 16;
+
+static int64_t nowNs() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static int bucketOf(uint64_t us) {
+  if (us == 0) return 0;
+  return std::min<int>(std::bit_width(us) - 1, RpcStats::bucket_count - 1);
+}
+
+uint64_t RpcStats::MethodStats::percentile(double p) const {
+  if (sampled == 0) return 0;
+  auto target = std::max<uint64_t>(1, (uint64_t)(sampled * p));
+  uint64_t seen = 0;
+  for (int i = 0; i < bucket_count; i++) {
+    seen += buckets[i];
+    if (seen >= target) {
+      return std::min<uint64_t>(max_us, (uint64_t)1 << (i + 1));
+    }
+  }
+  return max_us;
+}
+
+int64_t RpcStats::sampleStart() {
+  if (!s_enabled.load(std::memory_order_relaxed)) return -1;
+
+  // 每个线程各数各的，不用原子操作
+  thread_local uint32_t counter = 0;
+  auto rate = (uint32_t)s_sample_rate.load(std::memory_order_relaxed);
+  if (++counter < rate) return 0;
+  counter = 0;
+  return nowNs();
+}
+
+void RpcStats::setEnabled(bool enabled) {
+  s_enabled = enabled;
+}
+
+bool RpcStats::enabled() {
+  return s_enabled;
+}
+
+void RpcStats::setSampleRate(int n) {
+  s_sample_rate = std::max(n, 1);
+}
+
+int RpcStats::sampleRate() {
+  return s_sample_rate;
+}
+
+void RpcStats::record(Direction dir, std::string_view method, size_t request_bytes,
+                      size_t response_bytes, int64_t start) {
+  if (start < 0) return;
+
+  uint64_t us = 0;
+  if (start > 0) {
+    us = (uint64_t)std::max<int64_t>(nowNs() - start, 0) / 1000;
+  }
+
+  std::lock_guard<std::mutex> lock { m_mutex };
+  auto &map = dir == ToLua ? m_to_lua : m_from_lua;
+  auto it = map.find(method);
+  if (it == map.end()) {
+    // 方法名就那么几十个，只有第一次会分配
+    it = map.emplace(std::string { method }, MethodStats {}).first;
+  }
+
+  auto &s = it->second;
+  s.calls++;
+  s.request_bytes += request_bytes;
+  s.response_bytes += response_bytes;
+  if (start > 0) {
+    s.sampled++;
+    s.total_us += us;
+    s.max_us = std::max(s.max_us, us);
+    s.buckets[bucketOf(us)]++;
+  }
+}
+
+void RpcStats::reset() {
+  std::lock_guard<std::mutex> lock { m_mutex };
+  m_to_lua.clear();
+  m_from_lua.clear();
+}
+
+auto RpcStats::snapshot() const -> std::vector<Entry> {
+  std::vector<Entry> ret;
+  std::lock_guard<std::mutex> lock { m_mutex };
+  ret.reserve(m_to_lua.size() + m_from_lua.size());
+  for (auto &[name, s] : m_to_lua) {
+    ret.push_back({ ToLua, name, s });
+  }
+  for (auto &[name, s] : m_from_lua) {
+    ret.push_back({ FromLua, name, s });
+  }
+  return ret;
+}
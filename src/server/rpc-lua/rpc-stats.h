@@ -0,0 +1,66 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Lua桥的运行时统计：每个方法名、每个方向的调用次数、字节数和耗时直方图
+// 次数和字节数每次都记，耗时按sampleRate抽样，免得每个调用都去读时钟
+// 随时可以用shell的rpcstat命令开关、清零、导出，不用像RPC_DEBUG那样重新编译
+#pragma once
+
+class RpcStats {
+public:
+  enum Direction {
+    ToLua,    // 我们调Lua：call/callAsync
+    FromLua,  // Lua调我们：ServerRpcMethods
+  };
+
+  // 第i个桶是[2^i, 2^(i+1))微秒，第0个桶包括不到1微秒的，最后一个桶兜底
+  enum { bucket_count = 24 };
+
+  struct MethodStats {
+    uint64_t calls = 0;
+    uint64_t request_bytes = 0;   // 进程内模式下没有字节数，都是0
+    uint64_t response_bytes = 0;
+    uint64_t sampled = 0;
+    uint64_t total_us = 0;
+    uint64_t max_us = 0;
+    std::array<uint32_t, bucket_count> buckets {};
+
+    // 直方图估计的分位数，取桶的上界
+    uint64_t percentile(double p) const;
+  };
+
+  struct Entry {
+    Direction direction;
+    std::string method;
+    MethodStats stats;
+  };
+
+  // 在调用开始时取一次：-1表示统计已关闭，0表示这次不采样耗时，否则是开始时间
+  static int64_t sampleStart();
+
+  static void setEnabled(bool enabled);
+  static bool enabled();
+  // 每N次调用采样一次耗时，1表示每次都采
+  static void setSampleRate(int n);
+  static int sampleRate();
+
+  void record(Direction dir, std::string_view method, size_t request_bytes,
+              size_t response_bytes, int64_t start);
+  void reset();
+  // 给shell线程看的一份拷贝
+  std::vector<Entry> snapshot() const;
+
+private:
+  struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+  };
+  using StatsMap = std::unordered_map<std::string, MethodStats, StringHash, std::equal_to<>>;
+
+  // 记录在RoomThread里，读取在shell线程里，几乎不会抢
+  mutable std::mutex m_mutex;
+  StatsMap m_to_lua;
+  StatsMap m_from_lua;
+
+  static std::atomic<bool> s_enabled;
+  static std::atomic<int> s_sample_rate;
+};
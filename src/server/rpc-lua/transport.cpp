@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "server/rpc-lua/transport.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+namespace asio = boost::asio;
+using error_code = boost::system::error_code;
+
+PipeTransport::PipeTransport(stream_descriptor &in, stream_descriptor &out)
+  : child_stdin { in }, child_stdout { out } {}
+
+// asio::write内部会循环处理短写，保证整条消息都写进管道
+void PipeTransport::write(const char *data, size_t len, error_code &ec) {
+  asio::write(child_stdin, asio::buffer(data, len), ec);
+}
+
+size_t PipeTransport::readSome(char *buf, size_t len, error_code &ec) {
+  return child_stdout.read_some(asio::buffer(buf, len), ec);
+}
+
+size_t PipeTransport::tryRead(char *buf, size_t len, error_code &ec) {
+  error_code ignored;
+  child_stdout.non_blocking(true, ignored);
+  auto n = child_stdout.read_some(asio::buffer(buf, len), ec);
+  child_stdout.non_blocking(false, ignored);
+
+  if (ec == asio::error::would_block || ec == asio::error::try_again) {
+    ec = {};
+    return 0;
+  }
+  return n;
+}
+
+void PipeTransport::asyncWaitReadable(std::function<void(const error_code &)> handler) {
+  child_stdout.async_wait(stream_descriptor::wait_read, std::move(handler));
+}
+
+void PipeTransport::close() {
+  error_code ignored;
+  child_stdin.close(ignored);
+  child_stdout.close(ignored);
+}
+
+size_t ShmRing::write(const char *src, size_t len) {
+  auto cap = hdr->capacity;
+  auto head = hdr->head.load(std::memory_order_acquire);
+  auto tail = hdr->tail.load(std::memory_order_relaxed);
+
+  size_t n = std::min<size_t>(len, cap - (tail - head));
+  if (n == 0) return 0;
+
+  size_t pos = tail & (cap - 1);
+  size_t first = std::min<size_t>(n, cap - pos);
+  std::memcpy(data + pos, src, first);
+  std::memcpy(data, src + first, n - first);
+
+  hdr->tail.store(tail + n, std::memory_order_release);
+  return n;
+}
+
+size_t ShmRing::read(char *dst, size_t len) {
+  auto cap = hdr->capacity;
+  auto tail = hdr->tail.load(std::memory_order_acquire);
+  auto head = hdr->head.load(std::memory_order_relaxed);
+
+  size_t n = std::min<size_t>(len, tail - head);
+  if (n == 0) return 0;
+
+  size_t pos = head & (cap - 1);
+  size_t first = std::min<size_t>(n, cap - pos);
+  std::memcpy(dst, data + pos, first);
+  std::memcpy(dst + first, data, n - first);
+
+  hdr->head.store(head + n, std::memory_order_release);
+  return n;
+}
+
+size_t ShmRing::readable() const {
+  return hdr->tail.load(std::memory_order_acquire) - hdr->head.load(std::memory_order_acquire);
+}
+
+size_t ShmRing::writable() const {
+  return hdr->capacity - readable();
+}
+
+std::unique_ptr<ShmTransport> ShmTransport::create(asio::io_context &ctx, size_t ring_size) {
+  // 向上取到2的幂，至少64K
+  size_t cap = 64 * 1024;
+  while (cap < ring_size && cap < (1u << 30)) cap <<= 1;
+
+  std::unique_ptr<ShmTransport> t { new ShmTransport { ctx } };
+  t->ring_size = cap;
+  t->region_size = 2 * (sizeof(ShmRingHeader) + cap);
+
+  // 都带CLOEXEC，不然之后别的RoomThread fork出来的Lua也会继承一份；
+  // 只有自己的子进程在exec之前用inheritInChild把标志去掉
+  t->mem_fd = ::memfd_create("freekill-rpc", MFD_CLOEXEC);
+  if (t->mem_fd < 0 || ::ftruncate(t->mem_fd, t->region_size) != 0) {
+    spdlog::warn("Cannot create shared memory for Lua RPC: {}", strerror(errno));
+    return nullptr;
+  }
+
+  t->region = ::mmap(nullptr, t->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, t->mem_fd, 0);
+  if (t->region == MAP_FAILED) {
+    t->region = nullptr;
+    spdlog::warn("Cannot map shared memory for Lua RPC: {}", strerror(errno));
+    return nullptr;
+  }
+
+  t->lua_bell = ::eventfd(0, EFD_CLOEXEC);
+  t->server_bell = ::eventfd(0, EFD_CLOEXEC);
+  if (t->lua_bell < 0 || t->server_bell < 0) {
+    spdlog::warn("Cannot create eventfd for Lua RPC: {}", strerror(errno));
+    return nullptr;
+  }
+  t->server_bell_desc.assign(t->server_bell);
+
+  auto base = static_cast<char *>(t->region);
+  auto init_ring = [cap](char *p) {
+    auto hdr = new (p) ShmRingHeader;
+    hdr->head = 0;
+    hdr->tail = 0;
+    hdr->reader_sleeping = 0;
+    hdr->writer_sleeping = 0;
+    hdr->capacity = cap;
+    return ShmRing { hdr, p + sizeof(ShmRingHeader) };
+  };
+  t->to_lua = init_ring(base);
+  t->to_server = init_ring(base + sizeof(ShmRingHeader) + cap);
+
+  return t;
+}
+
+ShmTransport::~ShmTransport() {
+  if (region) ::munmap(region, region_size);
+  if (mem_fd >= 0) ::close(mem_fd);
+  if (lua_bell >= 0) ::close(lua_bell);
+  // server_bell归server_bell_desc管
+  if (server_bell >= 0 && !server_bell_desc.is_open()) ::close(server_bell);
+}
+
+void ShmTransport::inheritInChild() const {
+  for (int fd : { mem_fd, lua_bell, server_bell }) {
+    auto flags = ::fcntl(fd, F_GETFD);
+    if (flags >= 0) ::fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+  }
+}
+
+std::string ShmTransport::childEnv() const {
+  return fmt::format("{},{},{},{}", mem_fd, lua_bell, server_bell, ring_size);
+}
+
+void ShmTransport::attach(stream_descriptor &out) {
+  child_stdout = &out;
+}
+
+void ShmTransport::ring(int fd) {
+  uint64_t one = 1;
+  [[maybe_unused]] auto _ = ::write(fd, &one, sizeof(one));
+}
+
+void ShmTransport::resetBell() {
+  // asio可能已经把它设成非阻塞了；没设的话先poll一下免得卡住
+  pollfd pfd { server_bell, POLLIN, 0 };
+  if (::poll(&pfd, 1, 0) <= 0) return;
+  uint64_t val;
+  [[maybe_unused]] auto _ = ::read(server_bell, &val, sizeof(val));
+}
+
+void ShmTransport::waitBell(error_code &ec) {
+  pollfd fds[2] = {
+    { server_bell, POLLIN, 0 },
+    { child_stdout ? child_stdout->native_handle() : -1, POLLIN, 0 },
+  };
+
+  while (true) {
+    auto ret = ::poll(fds, 2, -1);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      ec = { errno, boost::system::system_category() };
+      return;
+    }
+    break;
+  }
+
+  // 换成共享内存后Lua不会再往管道里写东西，管道有动静就是子进程没了
+  if (fds[1].revents) {
+    ec = asio::error::eof;
+    return;
+  }
+
+  resetBell();
+}
+
+void ShmTransport::write(const char *data, size_t len, error_code &ec) {
+  auto hdr = to_lua.header();
+  while (len > 0) {
+    auto n = to_lua.write(data, len);
+    data += n;
+    len -= n;
+
+    if (n > 0 && hdr->reader_sleeping.exchange(0)) {
+      ring(lua_bell);
+    }
+    if (len == 0) break;
+
+    // 满了，等Lua读走一些
+    hdr->writer_sleeping = 1;
+    if (to_lua.writable() > 0) {
+      hdr->writer_sleeping = 0;
+      continue;
+    }
+    waitBell(ec);
+    if (ec) return;
+  }
+}
+
+size_t ShmTransport::tryRead(char *buf, size_t len, error_code &) {
+  resetBell();
+
+  auto n = to_server.read(buf, len);
+  if (n > 0 && to_server.header()->writer_sleeping.exchange(0)) {
+    ring(lua_bell);
+  }
+  return n;
+}
+
+size_t ShmTransport::readSome(char *buf, size_t len, error_code &ec) {
+  auto hdr = to_server.header();
+  while (true) {
+    auto n = to_server.read(buf, len);
+    if (n > 0) {
+      if (hdr->writer_sleeping.exchange(0)) ring(lua_bell);
+      return n;
+    }
+
+    hdr->reader_sleeping = 1;
+    if (to_server.readable() > 0) {
+      hdr->reader_sleeping = 0;
+      continue;
+    }
+    waitBell(ec);
+    if (ec) return 0;
+  }
+}
+
+void ShmTransport::asyncWaitReadable(std::function<void(const error_code &)> handler) {
+  // 先登记要睡了再检查一次，免得刚好错过Lua按门铃
+  to_server.header()->reader_sleeping = 1;
+  if (to_server.readable() > 0) {
+    asio::post(server_bell_desc.get_executor(), [handler = std::move(handler)] {
+      handler({});
+    });
+    return;
+  }
+  server_bell_desc.async_wait(stream_descriptor::wait_read, std::move(handler));
+}
+
+void ShmTransport::close() {
+  error_code ignored;
+  server_bell_desc.close(ignored);
+  server_bell = -1;
+  if (child_stdout) child_stdout->close(ignored);
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// RpcLua和Lua进程之间传CBOR字节流的通道
+// 默认走两根管道；Lua那边支持的话可以换成共享内存里的一对环形缓冲区，
+// 少掉每条消息进出内核的两次拷贝
+#pragma once
+
+class RpcTransport {
+public:
+  using error_code = boost::system::error_code;
+
+  virtual ~RpcTransport() = default;
+
+  // 全部写完才返回
+  virtual void write(const char *data, size_t len, error_code &ec) = 0;
+  // 阻塞到至少读到一点数据
+  virtual size_t readSome(char *buf, size_t len, error_code &ec) = 0;
+  // 不阻塞，没有数据就返回0
+  virtual size_t tryRead(char *buf, size_t len, error_code &ec) = 0;
+  // 有数据可读时在io_ctx中回调
+  virtual void asyncWaitReadable(std::function<void(const error_code &)> handler) = 0;
+  // 不再使用：取消挂着的异步等待，关掉通道
+  virtual void close() = 0;
+
+  virtual const char *name() const = 0;
+};
+
+class PipeTransport : public RpcTransport {
+public:
+  using stream_descriptor = boost::asio::posix::stream_descriptor;
+
+  PipeTransport(stream_descriptor &in, stream_descriptor &out);
+
+  void write(const char *data, size_t len, error_code &ec) override;
+  size_t readSome(char *buf, size_t len, error_code &ec) override;
+  size_t tryRead(char *buf, size_t len, error_code &ec) override;
+  void asyncWaitReadable(std::function<void(const error_code &)> handler) override;
+  void close() override;
+  const char *name() const override { return "pipe"; }
+
+private:
+  stream_descriptor &child_stdin;
+  stream_descriptor &child_stdout;
+};
+
+// 单生产者单消费者的字节环，放在共享内存里，父子进程各占一头
+// head/tail只增不减，取模得到下标；capacity必须是2的幂
+// 某一端准备睡觉前先把对应的sleeping置1再检查一遍，另一端看到了才按门铃，
+// 两边都忙的时候就不用每条消息都进一次内核
+struct ShmRingHeader {
+  alignas(64) std::atomic<uint32_t> head;  // 读端推进
+  alignas(64) std::atomic<uint32_t> tail;  // 写端推进
+  alignas(64) std::atomic<uint32_t> reader_sleeping;
+  std::atomic<uint32_t> writer_sleeping;
+  uint32_t capacity;
+};
+
+class ShmRing {
+public:
+  ShmRing() = default;
+  ShmRing(ShmRingHeader *hdr, char *data) : hdr { hdr }, data { data } {}
+
+  // 尽量写，返回实际写入的字节数
+  size_t write(const char *src, size_t len);
+  // 尽量读，返回实际读到的字节数
+  size_t read(char *dst, size_t len);
+
+  size_t readable() const;
+  size_t writable() const;
+  ShmRingHeader *header() const { return hdr; }
+
+private:
+  ShmRingHeader *hdr = nullptr;
+  char *data = nullptr;
+};
+
+// 内存布局：[to_lua头][to_lua数据][to_server头][to_server数据]
+// 每个方向一个eventfd当门铃：往对方的环里写了数据或者从对方写的环里腾出了空间就按一下
+// 管道仍然保留，只用来发现子进程退出（读到EOF）
+class ShmTransport : public RpcTransport {
+public:
+  using stream_descriptor = boost::asio::posix::stream_descriptor;
+
+  // 在fork之前调用；失败返回nullptr
+  static std::unique_ptr<ShmTransport> create(boost::asio::io_context &ctx,
+                                              size_t ring_size);
+  ~ShmTransport();
+
+  // 交给子进程的环境变量值："memfd,lua门铃,server门铃,环大小"
+  std::string childEnv() const;
+  // fork出来的子进程里、exec之前调用，让这几个fd留到Lua进程里
+  void inheritInChild() const;
+  // fork之后、确定要用它之前调用，绑定存活检测用的管道
+  void attach(stream_descriptor &child_stdout);
+
+  void write(const char *data, size_t len, error_code &ec) override;
+  size_t readSome(char *buf, size_t len, error_code &ec) override;
+  size_t tryRead(char *buf, size_t len, error_code &ec) override;
+  void asyncWaitReadable(std::function<void(const error_code &)> handler) override;
+  void close() override;
+  const char *name() const override { return "shm"; }
+
+private:
+  ShmTransport(boost::asio::io_context &ctx) : server_bell_desc { ctx } {}
+
+  // 等门铃响或者子进程退出
+  void waitBell(error_code &ec);
+  void ring(int fd);
+  void resetBell();
+
+  int mem_fd = -1;
+  int lua_bell = -1;     // 子进程在上面等
+  int server_bell = -1;  // 我们在上面等
+  void *region = nullptr;
+  size_t region_size = 0;
+  size_t ring_size = 0;
+
+  ShmRing to_lua;
+  ShmRing to_server;
+
+  stream_descriptor server_bell_desc;  // 给io_ctx异步等待用，assign之后server_bell归它关
+  stream_descriptor *child_stdout = nullptr;
+};
@@ -11,6 +11,7 @@
 #include "network/client_socket.h"
 #include "network/router.h"
 #include "network/http_listener.h"
+#include "network/io_pool.h"
 #include "server/gamelogic/roomthread.h"
 
 #include "server/admin/shell.h"
@@ -52,6 +53,10 @@ Server::Server() : m_socket { nullptr } {
 }
 
 Server::~Server() {
+  // 先让网络线程停下，之后再析构socket就不会有竞争了
+  if (m_io_pool) m_io_pool->stop();
+  if (m_http_listener) m_http_listener->stop();
+  if (m_socket) m_socket->stop();
 }
 
 awaitable<void> Server::heartbeat() {
@@ -75,10 +80,11 @@ awaitable<void> Server::heartbeat() {
       p->emitKicked();
     }
 
+    auto frame = Router::encodeNotification("Heartbeat", "");
     for (auto &[_, p] : m_user_manager->getPlayers()) {
       if (p->isOnline()) {
         p->ttl--;
-        p->doNotify("Heartbeat", "");
+        p->doNotify(frame, ClientSocket::MergeHeartbeat);
       }
     }
   }
@@ -88,6 +94,11 @@ void Server::listen(io_context &io_ctx, tcp::endpoint end, udp::endpoint uend) {
   main_io_ctx = &io_ctx;
 
   m_socket = std::make_unique<ServerSocket>(io_ctx, end, uend);
+  if (config().networkThreads > 0) {
+    m_io_pool = std::make_unique<IoContextPool>(config().networkThreads);
+    m_io_pool->start();
+    m_socket->setIoPool(m_io_pool.get());
+  }
   m_socket->set_new_connection_callback([this](std::shared_ptr<ClientSocket> p) {
     m_user_manager->processNewConnection(p);
   });
@@ -95,12 +106,56 @@ void Server::listen(io_context &io_ctx, tcp::endpoint end, udp::endpoint uend) {
 
   heartbeat_timer = std::make_unique<asio::steady_timer>(io_ctx);
   asio::co_spawn(io_ctx, heartbeat(), detached);
+  rebalance_timer = std::make_unique<asio::steady_timer>(io_ctx);
+  asio::co_spawn(io_ctx, rebalance(), detached);
+  load_timer = std::make_unique<asio::steady_timer>(io_ctx);
+  asio::co_spawn(io_ctx, sampleLoad(), detached);
 
   m_shell = std::make_unique<Shell>();
   m_shell->start();
 
-  // FIXME 此处仅供测试用
-  // (new HttpListener(tcp::endpoint { tcp::v6(), 9000 }))->start();
+  refillThreadPool();
+
+  if (config().webSocketPort > 0) {
+    m_http_listener = std::make_unique<HttpListener>(
+      tcp::endpoint { tcp::v6(), (unsigned short)config().webSocketPort });
+    m_http_listener->start();
+  }
+}
+
+awaitable<void> Server::rebalance() {
+  using namespace std::chrono_literals;
+  for (;;) {
+    // 配置随时可能被reloadconf改掉，关着的时候也隔一会儿看一眼
+    auto interval = config().rebalanceInterval;
+    rebalance_timer->expires_after(interval > 0 ? std::chrono::seconds(interval) : 30s);
+    boost::system::error_code ec;
+    co_await rebalance_timer->async_wait(redirect_error(use_awaitable, ec));
+    if (ec) {
+      spdlog::error(ec.message());
+      break;
+    }
+    if (config().rebalanceInterval > 0) {
+      rebalanceThreads();
+    }
+  }
+}
+
+// least-loaded看的CPU占用得是最近的，不能等到分配房间时才去量
+awaitable<void> Server::sampleLoad() {
+  using namespace std::chrono_literals;
+  for (;;) {
+    load_timer->expires_after(5s);
+    boost::system::error_code ec;
+    co_await load_timer->async_wait(redirect_error(use_awaitable, ec));
+    if (ec) {
+      spdlog::error(ec.message());
+      break;
+    }
+    for (auto &[_, thr] : m_threads) {
+      thr->sampleLoad();
+    }
+  }
 }
 
 void Server::stop() {
@@ -137,13 +192,22 @@ Shell &Server::shell() {
 }
 
 void Server::sendEarlyPacket(ClientSocket &client, const std::string_view &type, const std::string_view &msg) {
+  // 这时还没有Router，压缩要自己做；比如UpdatePackage里的包列表就很大
+  int pktType = Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT;
+  std::string compressed;
+  std::string_view data = msg;
+  if (auto compressor = client.compressor(); compressor && compressor->compress(msg, compressed)) {
+    pktType |= Router::COMPRESSED;
+    data = compressed;
+  }
+
   auto buf = Cbor::encodeArray({
     -2,
-    Router::TYPE_NOTIFICATION | Router::SRC_SERVER | Router::DEST_CLIENT,
+    pktType,
     type,
-    msg,
+    data,
   });
-  client.send(std::make_shared<std::string>(buf));
+  client.send(std::make_shared<const std::string>(std::move(buf)));
 }
 
 RoomThread &Server::createThread() {
@@ -165,17 +229,122 @@ std::weak_ptr<RoomThread> Server::getThread(int threadId) {
   return m_threads[threadId];
 }
 
-RoomThread &Server::getAvailableThread() {
+// 分数越低越优先
+static double placementScore(const std::string &placement, RoomThread &thr) {
+  if (placement == "spread") {
+    return thr.getRefCount();
+  } else if (placement == "least-loaded") {
+    // 一个百分点的CPU、两个排队的请求、一个开打的房间大致算一样重；
+    // 没开打的房间几乎不占资源，只用来在都差不多时分个先后
+    auto load = thr.load();
+    return load.cpu_percent + 2.0 * load.queued + load.started_rooms + 0.1 * thr.getRefCount();
+  }
+
+  // pack：房间越多越优先，空闲的留作预热池，实在不行才用它们
+  return -thr.getRefCount();
+}
+
+RoomThread *Server::pickThread(RoomThread *exclude) {
+  auto &placement = config().threadPlacement;
+  RoomThread *best = nullptr;
+  double best_score = 0;
   for (const auto &it : m_threads) {
     auto &thr = it.second;
+    if (thr.get() == exclude) continue;
     if (thr->isOutdated()) continue;
     if (thr->isFull()) continue;
-    return *thr;
+
+    auto score = placementScore(placement, *thr);
+    if (!best || score < best_score ||
+        (score == best_score && !best->isReady() && thr->isReady())) {
+      best = thr.get();
+      best_score = score;
+    }
   }
+  return best;
+}
 
+RoomThread &Server::getAvailableThread() {
+  auto best = pickThread();
+
+  // 用掉了一个空闲的就在之后补上，不耽误这次建房
+  if (!best || best->getRefCount() == 0) {
+    asio::post(*main_io_ctx, [this] { refillThreadPool(); });
+  }
+  if (best) return *best;
   return createThread();
 }
 
+void Server::rebalanceThreads() {
+  auto &rm = room_manager();
+
+  // 过期线程里还没开打的房间搬到新线程去，这样旧线程只等开打的那几局打完就能关掉；
+  // 开打的不能搬，它们的状态和玩家手里的都是旧包，新线程的Lua接不住
+  for (auto &[_, thr] : m_threads) {
+    if (!thr->isOutdated()) continue;
+    for (auto roomId : thr->getRooms()) {
+      auto room = rm.findRoom(roomId).lock();
+      if (!room || room->isStarted() || room->isMigrating()) continue;
+      auto target = pickThread(thr.get());
+      if (target && room->migrateTo(*target)) return;
+    }
+  }
+
+  // pack本来就是要往一个线程里堆，不用平衡
+  auto &placement = config().threadPlacement;
+  if (placement != "spread" && placement != "least-loaded") return;
+
+  RoomThread *hot = nullptr, *cold = nullptr;
+  double hot_score = 0, cold_score = 0;
+  for (auto &[_, thr] : m_threads) {
+    if (thr->isOutdated() || !thr->isReady()) continue;
+    auto score = placementScore(placement, *thr);
+    if (thr->getRefCount() > 1 && (!hot || score > hot_score)) {
+      hot = thr.get();
+      hot_score = score;
+    }
+    if (!thr->isFull() && (!cold || score < cold_score)) {
+      cold = thr.get();
+      cold_score = score;
+    }
+  }
+
+  // spread差两个房间以上才搬，least-loaded差不多是四分之一个核
+  auto threshold = placement == "spread" ? 2.0 : 25.0;
+  if (!hot || !cold || hot == cold || hot_score - cold_score < threshold) return;
+
+  // spread看的是房间数，搬没开打的最省事；least-loaded看的是负载，搬开打的才有用
+  bool want_started = placement == "least-loaded";
+  for (int pass = 0; pass < 2; pass++) {
+    bool started = pass == 0 ? want_started : !want_started;
+    if (started && !hot->supportsMigration()) continue;
+    for (auto roomId : hot->getRooms()) {
+      auto room = rm.findRoom(roomId).lock();
+      if (!room || room->isMigrating() || room->isStarted() != started) continue;
+      if (room->migrateTo(*cold)) return;
+    }
+  }
+}
+
+void Server::refillThreadPool() {
+  // pack只在线程满了才用新的，不用限制个数
+  int max_threads = INT_MAX;
+  if (config().threadPlacement != "pack") {
+    max_threads = config().maxRoomThreads > 0 ? config().maxRoomThreads
+      : std::max<int>(std::thread::hardware_concurrency(), 1);
+  }
+
+  int idle = 0, total = 0;
+  for (const auto &[_, thr] : m_threads) {
+    if (thr->isOutdated()) continue;
+    total++;
+    if (thr->getRefCount() == 0) idle++;
+  }
+  for (; idle < config().luaWarmPool && total < max_threads; idle++, total++) {
+    createThread();
+  }
+}
+
 const std::unordered_map<int, std::shared_ptr<RoomThread>> &
   Server::getThreads() const
 {
@@ -183,8 +352,9 @@ const std::unordered_map<int, std::shared_ptr<RoomThread>> &
 }
 
 void Server::broadcast(const std::string_view &command, const std::string_view &jsonData) {
+  auto frame = Router::encodeNotification(command, jsonData);
   for (auto &[_, p] : user_manager().getPlayers()) {
-    p->doNotify(command, jsonData);
+    p->doNotify(frame);
   }
 }
 
@@ -259,6 +429,76 @@ void ServerConfig::loadConf(const char* jsonStr) {
     maxPlayersPerDevice = static_cast<int>(item->valuedouble);
   }
 
+  if ((item = cJSON_GetObjectItem(root, "maxFrameSize")) && cJSON_IsNumber(item) && item->valuedouble > 0) {
+    maxFrameSize = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "networkThreads")) && cJSON_IsNumber(item) && item->valuedouble >= 0) {
+    networkThreads = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "outboundSoftLimit")) && cJSON_IsNumber(item) && item->valuedouble > 0) {
+    outboundSoftLimit = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "outboundHardLimit")) && cJSON_IsNumber(item) && item->valuedouble > 0) {
+    outboundHardLimit = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "compressThreshold")) && cJSON_IsNumber(item) && item->valuedouble >= 0) {
+    compressThreshold = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "webSocketPort")) && cJSON_IsNumber(item)) {
+    webSocketPort = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "udpRateLimit")) && cJSON_IsNumber(item)) {
+    udpRateLimit = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaShmRingSize")) && cJSON_IsNumber(item)) {
+    luaShmRingSize = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaMode")) && cJSON_IsString(item) && item->valuestring) {
+    luaMode = item->valuestring;
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaBatchSize")) && cJSON_IsNumber(item)) {
+    luaBatchSize = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaBatchDelay")) && cJSON_IsNumber(item)) {
+    luaBatchDelay = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaWarmPool")) && cJSON_IsNumber(item)) {
+    luaWarmPool = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "threadPlacement")) && cJSON_IsString(item) && item->valuestring) {
+    std::string_view v = item->valuestring;
+    if (v == "pack" || v == "spread" || v == "least-loaded") {
+      threadPlacement = v;
+    } else {
+      spdlog::warn("Unknown threadPlacement \"{}\", expected pack, spread or least-loaded; using \"{}\".",
+                   v, threadPlacement);
+    }
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "maxRoomThreads")) && cJSON_IsNumber(item)) {
+    maxRoomThreads = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "rebalanceInterval")) && cJSON_IsNumber(item)) {
+    rebalanceInterval = static_cast<int>(item->valuedouble);
+  }
+
+  if ((item = cJSON_GetObjectItem(root, "luaCheckpointInterval")) && cJSON_IsNumber(item)) {
+    luaCheckpointInterval = static_cast<int>(item->valuedouble);
+  }
+
   cJSON_Delete(root);
 }
 
@@ -277,6 +517,8 @@ void Server::reloadConfig() {
 
   m_config = std::make_unique<ServerConfig>();
   m_config->loadConf(jsonStr.c_str());
+
+  if (m_socket) m_socket->refreshDiscoveryInfo();
 }
 
 const ServerConfig &Server::config() const { return *m_config; }
@@ -411,6 +653,8 @@ void Server::_refreshMd5() {
   for (auto id : to_rm) {
     removeThread(id);
   }
+  // 旧的线程都过期了，按新的包提前准备好线程
+  if (main_io_ctx) refillThreadPool();
 
   std::vector<int> to_kick;
   for (auto &[pConnId, _] : rm.lobby().lock()->getPlayers()) {
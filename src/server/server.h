@@ -4,6 +4,8 @@
 
 class ServerSocket;
 class ClientSocket;
+class IoContextPool;
+class HttpListener;
 
 class UserManager;
 class RoomManager;
@@ -25,6 +27,33 @@ struct ServerConfig {
   bool enableWhitelist = false;
   int roomCountPerThread = 2000;
   int maxPlayersPerDevice = 1000;
+  int maxFrameSize = 1024 * 1024;  // 客户端发来的单个包的字节数上限
+  int networkThreads = 0;  // 网络线程数，0表示全在主线程；改了要重启才生效
+  // 每个连接发送积压的上限（字节）：超过软上限时合并/丢弃心跳之类的消息，超过硬上限断开
+  int outboundSoftLimit = 1024 * 1024;
+  int outboundHardLimit = 8 * 1024 * 1024;
+  // 对支持压缩的客户端，data超过这么多字节就压缩；0表示不压缩
+  int compressThreshold = 1024;
+  int webSocketPort = 0;  // WebSocket监听端口，0表示不开；改了要重启才生效
+  int udpRateLimit = 5;  // 每个IP每秒最多处理几个UDP探测包，0表示不限
+  // 大于0时尝试和Lua用共享内存环形缓冲区通信（每个方向的字节数），Lua不支持就还用管道
+  int luaShmRingSize = 0;
+  // "process"：每个RoomThread fork一个lua5.4；"embedded"：进程内lua_State（需要FK_EMBED_LUA编译）
+  std::string luaMode = "process";
+  // 一次发给Lua的HandleRequest最多合并几条；luaBatchDelay>0时最多等这么多毫秒攒一批
+  int luaBatchSize = 32;
+  int luaBatchDelay = 0;
+  // 保持这么多个还没有房间的RoomThread，Lua提前启动好，建房时不用等；0表示不预热
+  int luaWarmPool = 1;
+  // 新房间放进哪个RoomThread："pack"先把一个线程塞到roomCountPerThread个房间再用下一个；
+  // "spread"放进房间最少的线程；"least-loaded"按CPU占用、排队的请求数和开打的房间数挑最闲的
+  std::string threadPlacement = "pack";
+  // spread和least-loaded最多开这么多个RoomThread（都满了的情况除外），0表示CPU核数
+  int maxRoomThreads = 0;
+  // 每隔这么多秒检查一次要不要迁移房间（过期线程里开打的房间、spread/least-loaded下负载不均），0表示不自动迁移
+  int rebalanceInterval = 0;
+  // 每隔这么多秒让Lua给开打的房间存档，Lua进程崩溃重启后从存档接着打；0表示不存档
+  int luaCheckpointInterval = 60;
 
   void loadConf(const char *json);
 
@@ -63,6 +92,12 @@ public:
   void removeThread(int threadId);
   std::weak_ptr<RoomThread> getThread(int threadId);
   RoomThread &getAvailableThread();
+  // 把空闲的RoomThread补足到luaWarmPool个
+  void refillThreadPool();
+  // 按threadPlacement挑一个能放新房间的线程，没有就返回nullptr
+  RoomThread *pickThread(RoomThread *exclude = nullptr);
+  // 至多发起一次房间迁移
+  void rebalanceThreads();
   const std::unordered_map<int, std::shared_ptr<RoomThread>> &getThreads() const;
 
   void broadcast(const std::string_view &command, const std::string_view &jsonData);
@@ -87,6 +122,9 @@ public:
 
 private:
   explicit Server();
+  // 放最前面，最后析构：析构时别的成员里可能还有挂在这上面的socket
+  std::unique_ptr<IoContextPool> m_io_pool;
+  std::unique_ptr<HttpListener> m_http_listener;
   std::unique_ptr<ServerConfig> m_config;
   std::unique_ptr<ServerSocket> m_socket;
 
@@ -111,6 +149,10 @@ private:
   std::unique_ptr<boost::asio::steady_timer> heartbeat_timer;
 
   boost::asio::awaitable<void> heartbeat();
+  std::unique_ptr<boost::asio::steady_timer> rebalance_timer;
+  boost::asio::awaitable<void> rebalance();
+  std::unique_ptr<boost::asio::steady_timer> load_timer;
+  boost::asio::awaitable<void> sampleLoad();
 
   void _refreshMd5();
 };
@@ -31,10 +31,24 @@ struct AuthManagerPrivate {
     md5 = "";
     version = "unknown";
     uuid = "";
+    capabilities = "";
   }
 
+  // 第6个元素是可选的，老客户端不会发
   bool is_valid() {
-    return current_idx == 5;
+    return current_idx == 5 || current_idx == 6;
+  }
+
+  // capabilities是逗号分隔的列表
+  bool hasCapability(const std::string_view &cap) const {
+    auto rest = capabilities;
+    while (!rest.empty()) {
+      auto pos = rest.find(',');
+      if (rest.substr(0, pos) == cap) return true;
+      if (pos == std::string_view::npos) break;
+      rest.remove_prefix(pos + 1);
+    }
+    return false;
   }
 
   void handle(cbor_data data, size_t sz) {
@@ -55,6 +69,9 @@ struct AuthManagerPrivate {
       case 4:
         uuid = sv;
         break;
+      case 5:
+        capabilities = sv;
+        break;
     }
     current_idx++;
   }
@@ -69,6 +86,7 @@ struct AuthManagerPrivate {
   std::string_view md5;
   std::string_view version;
   std::string_view uuid;
+  std::string_view capabilities;  // 客户端支持的可选功能，比如"deflate"
 
   // parsing
   int current_idx;
@@ -138,6 +156,13 @@ void AuthManager::processNewConnection(std::shared_ptr<ClientSocket> conn, Packe
   p_ptr->client = conn;
 
   if (!loadSetupData(packet)) { return; }
+
+  // 知道客户端支持什么之后马上开，checkMd5失败时发的UpdatePackage也能压缩
+  auto threshold = server.config().compressThreshold;
+  if (threshold > 0 && p_ptr->hasCapability("deflate")) {
+    conn->enableCompression(threshold);
+  }
+
   if (!checkVersion()) { return; }
   if (!checkIfUuidNotBanned()) { return; }
   if (!checkMd5()) { return; }
@@ -175,8 +200,8 @@ bool AuthManager::loadSetupData(const Packet &packet) {
   }
 
   p_ptr->reset();
-  // 一个array带5个bytes 懒得判那么细了解析出5个就行
-  for (int i = 0; i < 6; i++) {
+  // 一个array带5个bytes（新客户端可能再多带一个capabilities） 懒得判那么细了解析出来就行
+  for (int i = 0; i < 7; i++) {
     res = cbor_stream_decode(
       (cbor_data)data.data() + consumed,
       data.size() - consumed,
@@ -201,12 +201,16 @@ void Player::doRequest(const std::string_view &command,
 
 std::string Player::waitForReply(int timeout) {
   std::string ret;
+  waitForReply(timeout, ret);
+  return ret;
+}
+
+void Player::waitForReply(int timeout, std::string &out) {
   if (getState() != Player::Online) {
-    ret = "__cancel";
+    out = "__cancel";
   } else {
-    ret = m_router->waitForReply(timeout);
+    m_router->waitForReply(timeout, out);
   }
-  return ret;
 }
 
 void Player::doNotify(const std::string_view &command, const std::string_view &data) {
@@ -221,6 +225,13 @@ void Player::doNotify(const std::string_view &command, const std::string_view &d
   m_router->notify(type, command, data == "" ? "\xF6" : data);
 }
 
+void Player::doNotify(const std::shared_ptr<const std::string> &frame, int mergeKey) {
+  if (!isOnline())
+    return;
+
+  m_router->notify(frame, mergeKey);
+}
+
 bool Player::thinking() {
   std::lock_guard<std::mutex> locker { m_thinking_mutex };
   return m_thinking;
@@ -265,8 +276,7 @@ void Player::onDisconnected() {
   } else if (thinking()) {
     auto room = dynamic_pointer_cast<Room>(room_);
     if (!room) return;
-    auto thread = room->thread().lock();
-    if (thread) thread->wakeUp(room->getId(), "player_disconnect");
+    room->withThread([roomId = room->getId()](RoomThread &t) { t.wakeUp(roomId, "player_disconnect"); });
   }
 }
 
@@ -341,10 +351,7 @@ void Player::onReplyReady() {
 
   auto room = dynamic_pointer_cast<Room>(getRoom().lock());
   if (!room) return;
-  auto thread = room->thread().lock();
-  if (thread) {
-    thread->wakeUp(room->getId(), "reply");
-  }
+  room->withThread([roomId = room->getId()](RoomThread &t) { t.wakeUp(roomId, "reply"); });
 }
 
 void Player::onStateChanged() {
@@ -353,8 +360,9 @@ void Player::onStateChanged() {
   auto room = dynamic_pointer_cast<Room>(getRoom().lock());
   if (!room) return;
 
-  auto thread = room->thread().lock();
-  if (thread) thread->setPlayerState(connId, id, room->getId());
+  room->withThread([connId = connId, id = id, roomId = room->getId()](RoomThread &t) {
+    t.setPlayerState(connId, id, roomId);
+  });
 
   room->doBroadcastNotify(room->getPlayers(), "NetStateChanged",
                           Cbor::encodeArray({ id, getStateString() }));
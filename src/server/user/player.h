@@ -72,7 +72,11 @@ public:
   void doRequest(const std::string_view &command,
                  const std::string_view &jsonData, int timeout = -1, int64_t timestamp = -1);
   std::string waitForReply(int timeout);
+  void waitForReply(int timeout, std::string &out);
   void doNotify(const std::string_view &command, const std::string_view &data);
+  // 发送Router::encodeNotification编码好的包，广播时用
+  // mergeKey见ClientSocket::MergeKey，积压时可以被合并掉的消息才传
+  void doNotify(const std::shared_ptr<const std::string> &frame, int mergeKey = 0);
 
   // 心跳用，若连续TTL个心跳都不回应就踢
   enum { max_ttl = 6 };
@@ -48,6 +48,7 @@ void UserManager::addPlayer(std::shared_ptr<Player> player) {
       online_players_map.erase(id);
 
     online_players_map[id] = player;
+    online_count = online_players_map.size();
   } else {
     if (robots_map[id]) [[unlikely]]
       robots_map.erase(id);
@@ -67,6 +68,7 @@ void UserManager::removePlayer(Player &p, int id) {
   if (online_players_map.find(id) != online_players_map.end() &&
     online_players_map[id].get() == &p) {
     online_players_map.erase(id);
+    online_count = online_players_map.size();
   }
   if (robots_map.find(id) != robots_map.end()) {
     robots_map.erase(id);
@@ -84,6 +86,10 @@ const std::unordered_map<int, std::shared_ptr<Player>> &UserManager::getPlayers(
   return online_players_map;
 }
 
+size_t UserManager::onlineCount() const {
+  return online_count;
+}
+
 void UserManager::processNewConnection(std::shared_ptr<ClientSocket> client) {
   auto addr = client->peerAddress();
   spdlog::info("client {} connected", addr);
@@ -111,6 +117,9 @@ void UserManager::processNewConnection(std::shared_ptr<ClientSocket> client) {
     return;
   }
 
+  client->setMaxFrameSize(server.config().maxFrameSize);
+  client->setSendLimits(server.config().outboundSoftLimit, server.config().outboundHardLimit);
+
   // network delay test
   server.sendEarlyPacket(*client, "NetworkDelayTest", m_auth->getPublicKeyCbor());
   client->set_message_got_callback([this, client](Packet &p) {
@@ -20,6 +20,8 @@ public:
   void removePlayerByConnId(int connid);
 
   const std::unordered_map<int, std::shared_ptr<Player>> &getPlayers() const;
+  // 即getPlayers().size()，但可以在其他线程读
+  size_t onlineCount() const;
 
   void processNewConnection(std::shared_ptr<ClientSocket> client);
 
@@ -36,6 +38,7 @@ private:
   // Id -> Player
   std::unordered_map<int, std::shared_ptr<Player>> robots_map;
   std::unordered_map<int, std::shared_ptr<Player>> online_players_map;
+  std::atomic<size_t> online_count = 0;
 
   std::weak_ptr<Player> findRobot(int id) const;
 };